@@ -0,0 +1,126 @@
+/**
+ * SPDX-FileCopyrightText: 2023 Sebastien Jodogne, UCLouvain, Belgium
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/**
+ * OHIF plugin for Orthanc
+ * Copyright (C) 2023 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+
+#include "AdmissionControl.h"
+
+#include <OrthancException.h>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+
+
+AdmissionControl::Ticket::Ticket(AdmissionControl& that) :
+  that_(that)
+{
+  that_.Enter();
+}
+
+
+AdmissionControl::Ticket::~Ticket()
+{
+  that_.Leave();
+}
+
+
+void AdmissionControl::Enter()
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  if (maxActive_ == 0 ||
+      active_ < maxActive_)
+  {
+    active_++;
+    return;
+  }
+
+  if (queued_ >= maxQueued_)
+  {
+    refused_++;
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_Timeout, Orthanc::HttpStatus_503_ServiceUnavailable,
+                                    "Too many pending requests for " + name_, false);
+  }
+
+  queued_++;
+
+  const boost::system_time deadline = boost::get_system_time() + boost::posix_time::seconds(timeout_);
+
+  while (maxActive_ != 0 &&
+         active_ >= maxActive_)
+  {
+    if (!released_.timed_wait(lock, deadline) &&
+        maxActive_ != 0 &&
+        active_ >= maxActive_)
+    {
+      queued_--;
+      refused_++;
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_Timeout, Orthanc::HttpStatus_503_ServiceUnavailable,
+                                      "Timeout while waiting for " + name_, false);
+    }
+  }
+
+  queued_--;
+  active_++;
+}
+
+
+void AdmissionControl::Leave()
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  active_--;
+  released_.notify_one();
+}
+
+
+AdmissionControl::AdmissionControl(const std::string& name) :
+  name_(name),
+  maxActive_(0),
+  maxQueued_(0),
+  timeout_(0),
+  active_(0),
+  queued_(0),
+  refused_(0)
+{
+}
+
+
+void AdmissionControl::SetLimits(unsigned int maxActive,
+                                 unsigned int maxQueued,
+                                 unsigned int timeout)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  maxActive_ = maxActive;
+  maxQueued_ = maxQueued;
+  timeout_ = timeout;
+  released_.notify_all();
+}
+
+
+void AdmissionControl::GetStatistics(Statistics& target)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  target.active_ = active_;
+  target.queued_ = queued_;
+  target.refused_ = refused_;
+}
@@ -0,0 +1,89 @@
+/**
+ * SPDX-FileCopyrightText: 2023 Sebastien Jodogne, UCLouvain, Belgium
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/**
+ * OHIF plugin for Orthanc
+ * Copyright (C) 2023 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+
+#pragma once
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <stdint.h>
+#include <string>
+
+
+/**
+ * Limits the number of HTTP threads of Orthanc that are running the
+ * same kind of work at once. The requests that exceed the limit wait
+ * in a bounded queue, and are refused if the queue is full or if they
+ * have waited for too long. A refused request raises an exception
+ * whose HTTP status is "503 Service Unavailable", so that the client
+ * can retry later instead of pinning one more thread of Orthanc.
+ **/
+class AdmissionControl : public boost::noncopyable
+{
+public:
+  struct Statistics
+  {
+    unsigned int  active_;
+    unsigned int  queued_;
+    uint64_t      refused_;
+  };
+
+  class Ticket : public boost::noncopyable
+  {
+  private:
+    AdmissionControl&  that_;
+
+  public:
+    // Blocks until the request is admitted, or throws
+    explicit Ticket(AdmissionControl& that);
+
+    ~Ticket();
+  };
+
+private:
+  boost::mutex               mutex_;
+  boost::condition_variable  released_;
+  std::string                name_;
+  unsigned int               maxActive_;  // 0 means no limit
+  unsigned int               maxQueued_;
+  unsigned int               timeout_;    // In seconds
+  unsigned int               active_;
+  unsigned int               queued_;
+  uint64_t                   refused_;
+
+  void Enter();
+
+  void Leave();
+
+public:
+  explicit AdmissionControl(const std::string& name);
+
+  void SetLimits(unsigned int maxActive,
+                 unsigned int maxQueued,
+                 unsigned int timeout);
+
+  void GetStatistics(Statistics& target);
+};
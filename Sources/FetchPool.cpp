@@ -0,0 +1,264 @@
+/**
+ * SPDX-FileCopyrightText: 2023 Sebastien Jodogne, UCLouvain, Belgium
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/**
+ * OHIF plugin for Orthanc
+ * Copyright (C) 2023 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+
+#include "FetchPool.h"
+
+#include <Logging.h>
+
+#include <cassert>
+#include <memory>
+
+
+struct FetchPool::Running
+{
+  IBatch&               batch_;
+  size_t                size_;
+  size_t                next_;     // Index of the next task to be started
+  size_t                done_;     // Number of completed tasks
+  unsigned int          helpers_;  // Number of threads of the pool working on this batch
+  std::unique_ptr<Orthanc::OrthancException>  error_;  // First error
+
+  explicit Running(IBatch& batch) :
+    batch_(batch),
+    size_(batch.GetSize()),
+    next_(0),
+    done_(0),
+    helpers_(0)
+  {
+  }
+};
+
+
+Orthanc::OrthancException* FetchPool::Execute(Running& running,
+                                              size_t index)
+{
+  // The mutex must NOT be locked
+
+  try
+  {
+    running.batch_.Execute(index);
+    return NULL;
+  }
+  catch (Orthanc::OrthancException& e)
+  {
+    return new Orthanc::OrthancException(e);
+  }
+  catch (std::exception& e)
+  {
+    return new Orthanc::OrthancException(Orthanc::ErrorCode_InternalError, e.what());
+  }
+  catch (...)
+  {
+    return new Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+  }
+}
+
+
+void FetchPool::Complete(Running& running,
+                         Orthanc::OrthancException* error)
+{
+  // The mutex must be locked
+
+  std::unique_ptr<Orthanc::OrthancException> protection(error);
+
+  if (protection.get() != NULL &&
+      running.error_.get() == NULL)
+  {
+    running.error_.reset(protection.release());
+  }
+
+  running.done_++;
+}
+
+
+FetchPool::Running* FetchPool::Pick()
+{
+  // The mutex must be locked. The batches in the queue have at least
+  // one task that is not started yet.
+
+  for (std::list<Running*>::iterator it = queue_.begin(); it != queue_.end(); ++it)
+  {
+    if ((*it)->helpers_ < maxPerBatch_)
+    {
+      // Round-robin: The batch goes to the back of the queue
+      Running* running = *it;
+      queue_.erase(it);
+      queue_.push_back(running);
+      return running;
+    }
+  }
+
+  return NULL;
+}
+
+
+void FetchPool::Worker(FetchPool* that)
+{
+  boost::mutex::scoped_lock lock(that->mutex_);
+
+  while (!that->stopped_)
+  {
+    Running* running = that->Pick();
+
+    if (running == NULL)
+    {
+      that->taskAvailable_.wait(lock);
+    }
+    else
+    {
+      const size_t index = running->next_++;
+      if (running->next_ == running->size_)
+      {
+        that->queue_.remove(running);
+      }
+
+      running->helpers_++;
+
+      lock.unlock();
+      Orthanc::OrthancException* error = Execute(*running, index);
+      lock.lock();
+
+      running->helpers_--;
+      Complete(*running, error);
+
+      if (running->done_ == running->size_)
+      {
+        that->taskDone_.notify_all();
+      }
+    }
+  }
+}
+
+
+FetchPool::FetchPool() :
+  maxPerBatch_(0),
+  stopped_(false)
+{
+}
+
+
+FetchPool::~FetchPool()
+{
+  if (!threads_.empty())
+  {
+    LOG(ERROR) << "FetchPool::Stop() should have been manually called";
+    Stop();
+  }
+}
+
+
+void FetchPool::Start(unsigned int threads,
+                      unsigned int maxPerBatch)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  if (!threads_.empty())
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+  }
+
+  stopped_ = false;
+  maxPerBatch_ = maxPerBatch;
+
+  for (unsigned int i = 0; i < threads; i++)
+  {
+    threads_.push_back(new boost::thread(Worker, this));
+  }
+}
+
+
+void FetchPool::Stop()
+{
+  std::vector<boost::thread*> threads;
+
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    stopped_ = true;
+    threads.swap(threads_);
+    taskAvailable_.notify_all();
+  }
+
+  for (size_t i = 0; i < threads.size(); i++)
+  {
+    assert(threads[i] != NULL);
+    if (threads[i]->joinable())
+    {
+      threads[i]->join();
+    }
+
+    delete threads[i];
+  }
+}
+
+
+void FetchPool::Run(IBatch& batch)
+{
+  Running running(batch);
+
+  if (running.size_ == 0)
+  {
+    return;
+  }
+
+  boost::mutex::scoped_lock lock(mutex_);
+
+  if (running.size_ > 1 &&
+      !stopped_ &&
+      !threads_.empty() &&
+      maxPerBatch_ > 0)
+  {
+    queue_.push_back(&running);
+    taskAvailable_.notify_all();
+  }
+
+  // The calling thread executes the tasks that are not started yet,
+  // which guarantees progress even if the pool is saturated or stopped
+  while (running.next_ < running.size_)
+  {
+    const size_t index = running.next_++;
+    if (running.next_ == running.size_)
+    {
+      queue_.remove(&running);
+    }
+
+    lock.unlock();
+    Orthanc::OrthancException* error = Execute(running, index);
+    lock.lock();
+
+    Complete(running, error);
+  }
+
+  // Wait for the tasks that were started by the threads of the pool
+  while (running.done_ < running.size_)
+  {
+    taskDone_.wait(lock);
+  }
+
+  if (running.error_.get() != NULL)
+  {
+    throw Orthanc::OrthancException(*running.error_);
+  }
+}
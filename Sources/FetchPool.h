@@ -0,0 +1,101 @@
+/**
+ * SPDX-FileCopyrightText: 2023 Sebastien Jodogne, UCLouvain, Belgium
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/**
+ * OHIF plugin for Orthanc
+ * Copyright (C) 2023 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+
+#pragma once
+
+#include <OrthancException.h>
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <list>
+#include <vector>
+
+
+/**
+ * Pool of threads that is shared by the whole plugin, and that runs
+ * the REST calls of one request in parallel. A request submits a
+ * batch of independent tasks, identified by their index, and helps
+ * the pool to execute them until the batch is drained. At most
+ * "maxPerBatch" threads of the pool work on the same batch, and the
+ * threads of the pool serve the pending batches in a round-robin
+ * fashion, so that a huge study cannot starve the other requests. As
+ * each task writes its result at its own index, the output does not
+ * depend on the order of execution.
+ **/
+class FetchPool : public boost::noncopyable
+{
+public:
+  class IBatch : public boost::noncopyable
+  {
+  public:
+    virtual ~IBatch()
+    {
+    }
+
+    virtual size_t GetSize() const = 0;
+
+    // Must be thread-safe across distinct indices
+    virtual void Execute(size_t index) = 0;
+  };
+
+private:
+  struct Running;
+
+  boost::mutex                  mutex_;
+  boost::condition_variable     taskAvailable_;
+  boost::condition_variable     taskDone_;
+  std::list<Running*>           queue_;
+  std::vector<boost::thread*>   threads_;
+  unsigned int                  maxPerBatch_;
+  bool                          stopped_;
+
+  // Returns the error raised by the task, if any
+  static Orthanc::OrthancException* Execute(Running& running,
+                                            size_t index);
+
+  static void Complete(Running& running,
+                       Orthanc::OrthancException* error);
+
+  static void Worker(FetchPool* that);
+
+  Running* Pick();
+
+public:
+  FetchPool();
+
+  ~FetchPool();
+
+  void Start(unsigned int threads,
+             unsigned int maxPerBatch);
+
+  void Stop();
+
+  // Blocks until all the tasks of the batch are executed. If some
+  // task fails, the first error is rethrown once the batch is done.
+  void Run(IBatch& batch);
+};
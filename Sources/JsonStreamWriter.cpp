@@ -0,0 +1,240 @@
+/**
+ * SPDX-FileCopyrightText: 2023 Sebastien Jodogne, UCLouvain, Belgium
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/**
+ * OHIF plugin for Orthanc
+ * Copyright (C) 2023 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+
+#include "JsonStreamWriter.h"
+
+#include <OrthancException.h>
+#include <Toolbox.h>
+
+#include <cassert>
+#include <stdio.h>
+
+
+void JsonStreamWriter::Separate()
+{
+  if (afterKey_)
+  {
+    afterKey_ = false;
+  }
+  else if (!empty_.empty())
+  {
+    if (empty_.back())
+    {
+      empty_.back() = false;
+    }
+    else
+    {
+      target_.push_back(',');
+    }
+  }
+}
+
+
+void JsonStreamWriter::AppendString(const std::string& value)
+{
+  target_.push_back('"');
+
+  for (size_t i = 0; i < value.size(); i++)
+  {
+    const char c = value[i];
+
+    switch (c)
+    {
+      case '"':
+        target_.append("\\\"");
+        break;
+
+      case '\\':
+        target_.append("\\\\");
+        break;
+
+      case '\b':
+        target_.append("\\b");
+        break;
+
+      case '\f':
+        target_.append("\\f");
+        break;
+
+      case '\n':
+        target_.append("\\n");
+        break;
+
+      case '\r':
+        target_.append("\\r");
+        break;
+
+      case '\t':
+        target_.append("\\t");
+        break;
+
+      default:
+        if (static_cast<unsigned char>(c) < 0x20)
+        {
+          char buffer[8];
+          sprintf(buffer, "\\u%04x", static_cast<unsigned int>(static_cast<unsigned char>(c)));
+          target_.append(buffer);
+        }
+        else
+        {
+          // UTF-8 sequences are copied as such
+          target_.push_back(c);
+        }
+    }
+  }
+
+  target_.push_back('"');
+}
+
+
+JsonStreamWriter::JsonStreamWriter(std::string& target) :
+  target_(target),
+  afterKey_(false)
+{
+}
+
+
+void JsonStreamWriter::StartObject()
+{
+  Separate();
+  target_.push_back('{');
+  empty_.push_back(true);
+}
+
+
+void JsonStreamWriter::EndObject()
+{
+  if (empty_.empty() ||
+      afterKey_)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+  }
+
+  target_.push_back('}');
+  empty_.pop_back();
+}
+
+
+void JsonStreamWriter::StartArray()
+{
+  Separate();
+  target_.push_back('[');
+  empty_.push_back(true);
+}
+
+
+void JsonStreamWriter::EndArray()
+{
+  if (empty_.empty() ||
+      afterKey_)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+  }
+
+  target_.push_back(']');
+  empty_.pop_back();
+}
+
+
+void JsonStreamWriter::Key(const std::string& key)
+{
+  if (empty_.empty() ||
+      afterKey_)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+  }
+
+  Separate();
+  AppendString(key);
+  target_.push_back(':');
+  afterKey_ = true;
+}
+
+
+void JsonStreamWriter::String(const std::string& value)
+{
+  Separate();
+  AppendString(value);
+}
+
+
+void JsonStreamWriter::Value(const Json::Value& value)
+{
+  if (value.type() == Json::stringValue)
+  {
+    String(value.asString());
+  }
+  else
+  {
+    Separate();
+
+    std::string s;
+    Orthanc::Toolbox::WriteFastJson(s, value);
+    target_.append(s);
+  }
+}
+
+
+void JsonStreamWriter::Raw(const std::string& value)
+{
+  Separate();
+  target_.append(value);
+}
+
+
+void JsonStreamWriter::RawMember(const std::string& member)
+{
+  if (empty_.empty() ||
+      afterKey_)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+  }
+
+  Separate();
+  target_.append(member);
+}
+
+
+void JsonStreamWriter::FormatMember(std::string& target,
+                                    const std::string& key,
+                                    const Json::Value& value)
+{
+  std::string s;
+
+  {
+    JsonStreamWriter writer(s);
+    writer.StartObject();
+    writer.Key(key);
+    writer.Value(value);
+    writer.EndObject();
+  }
+
+  // Strip the enclosing braces
+  assert(s.size() > 2 &&
+         s[0] == '{' &&
+         s[s.size() - 1] == '}');
+  target.assign(s, 1, s.size() - 2);
+}
@@ -0,0 +1,87 @@
+/**
+ * SPDX-FileCopyrightText: 2023 Sebastien Jodogne, UCLouvain, Belgium
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/**
+ * OHIF plugin for Orthanc
+ * Copyright (C) 2023 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+
+#pragma once
+
+#include <json/value.h>
+
+#include <boost/noncopyable.hpp>
+#include <string>
+#include <vector>
+
+
+/**
+ * Emits a JSON document token by token at the end of a buffer, which
+ * avoids building the whole "Json::Value" tree of the document before
+ * serializing it. The caller is responsible for the proper nesting
+ * of the objects and of the arrays.
+ **/
+class JsonStreamWriter : public boost::noncopyable
+{
+private:
+  std::string&       target_;
+  std::vector<bool>  empty_;  // For each open container, whether it has no element yet
+  bool               afterKey_;
+
+  void Separate();
+
+  void AppendString(const std::string& value);
+
+public:
+  explicit JsonStreamWriter(std::string& target);
+
+  void StartObject();
+
+  void EndObject();
+
+  void StartArray();
+
+  void EndArray();
+
+  void Key(const std::string& key);
+
+  void String(const std::string& value);
+
+  void Value(const Json::Value& value);
+
+  // Inserts a value that is already serialized
+  void Raw(const std::string& value);
+
+  // Inserts a member of an object that is already serialized, as
+  // formatted by "FormatMember()"
+  void RawMember(const std::string& member);
+
+  // Serializes one member of an object, i.e. a key and its value
+  static void FormatMember(std::string& target,
+                           const std::string& key,
+                           const Json::Value& value);
+
+  // Tells whether all the open objects and arrays were closed
+  bool IsComplete() const
+  {
+    return empty_.empty();
+  }
+};
@@ -60,6 +60,16 @@ $('#study').live('pagebeforeshow', function() {
       b.insertAfter($('#study-info'));
       
       b.click(function() {
+        if (!${USE_DICOM_WEB}) {
+          // Ask the plugin to precompute the study in priority, while
+          // the user is choosing the viewer
+          $.ajax({
+            url: '../studies/' + studyId + '/ohif-preload',
+            type: 'POST',
+            dataType: 'json'
+          });
+        }
+
         var viewers = $('<ul>')
             .attr('data-divider-theme', 'd')
             .attr('data-role', 'listview');
@@ -106,6 +116,32 @@ $('#study').live('pagebeforeshow', function() {
 });
 
 
+if (!${USE_DICOM_WEB}) {
+  // Only the DICOM-JSON data source can open one single series, using
+  // the document of this series instead of the document of its study
+  $('#series').live('pagebeforeshow', function() {
+    var seriesId = $.mobile.pageData.uuid;
+
+    $('#ohif-series-button').remove();
+
+    var b = $('<a>')
+        .attr('id', 'ohif-series-button')
+        .attr('data-role', 'button')
+        .attr('href', '#')
+        .attr('data-icon', 'search')
+        .attr('data-theme', 'e')
+        .text('Open series in OHIF viewer')
+        .button();
+
+    b.insertAfter($('#series-info'));
+
+    b.click(function() {
+      window.open('../ohif/viewer?url=../series/' + seriesId + '/ohif-dicom-json');
+    });
+  });
+}
+
+
 if (${USE_DICOM_WEB}) {
   $('#lookup').live('pagebeforeshow', function() {
     $('#open-ohif-study-list').remove();
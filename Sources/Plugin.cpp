@@ -22,13 +22,22 @@
  **/
 
 
+#include "AdmissionControl.h"
+#include "FetchPool.h"
+#include "JsonStreamWriter.h"
+#include "PreloadQueue.h"
+#include "PreloadThrottle.h"
+#include "SeriesRecordsCache.h"
+#include "SeriesVolume.h"
+#include "SingleFlight.h"
 #include "../Resources/Orthanc/Plugins/OrthancPluginCppWrapper.h"
 
+#include <Cache/LeastRecentlyUsedIndex.h>
 #include <Compression/GzipCompressor.h>
+#include <Compression/ZlibCompressor.h>
 #include <DicomFormat/DicomInstanceHasher.h>
 #include <DicomFormat/DicomMap.h>
 #include <Logging.h>
-#include <MultiThreading/SharedMessageQueue.h>
 #include <SerializationToolbox.h>
 #include <SystemToolbox.h>
 #include <Toolbox.h>
@@ -37,11 +46,24 @@
 
 #include <boost/thread.hpp>
 #include <boost/thread/shared_mutex.hpp>
+#include <algorithm>
+#include <limits>
 
 
 static const std::string  METADATA_OHIF = "4202";
 static const char* const  KEY_VERSION = "Version";
+static const char* const  KEY_INSTANCES = "Instances";
 static const unsigned int MAX_INSTANCES_IN_QUEUE = 10000;
+static const size_t       SERIES_MUTEXES = 64;
+static const size_t       SERIES_RECORDS_CACHE_SHARDS = 16;
+static const size_t       SERIES_FLUSH_SIZE = 1000;   // Number of pending instances
+static const size_t       COALESCE_MINIMUM = 10;      // Number of queued instances
+static const unsigned int SERIES_FLUSH_DELAY = 60;    // In seconds
+static const unsigned int RETRY_AFTER = 5;            // In seconds
+static const unsigned int LAST_UPDATE_MARGIN = 5;     // In seconds
+static const size_t       STUDY_FINGERPRINTS = 1000;  // Number of studies
+static const int32_t      GLOBAL_PROPERTY_METADATA_VERSION = 4202;
+static const int32_t      GLOBAL_PROPERTY_BACKFILL_CHECKPOINT = 4203;
 
 
 enum DataSource
@@ -68,6 +90,7 @@ class TagInformation
 private:
   DataType     type_;
   std::string  name_;
+  std::string  key_;  // Formatted tag, as found in the "?short" format
   
 public:
   TagInformation() :
@@ -92,6 +115,16 @@ public:
     return name_;
   }
 
+  void SetKey(const std::string& key)
+  {
+    key_ = key;
+  }
+
+  const std::string& GetKey() const
+  {
+    return key_;
+  }
+
   bool operator== (const TagInformation& other) const
   {
     return (type_ == other.type_ &&
@@ -106,6 +139,14 @@ static TagsDictionary ohifStudyTags_, ohifSeriesTags_, ohifInstanceTags_, allTag
 
 static const Orthanc::DicomTag RADIOPHARMACEUTICAL_INFORMATION_SEQUENCE(0x0054, 0x0016);
 
+static void FormatKeys(TagsDictionary& tags)
+{
+  for (TagsDictionary::iterator it = tags.begin(); it != tags.end(); ++it)
+  {
+    it->second.SetKey(it->first.Format());
+  }
+}
+
 static void InitializeOhifTags()
 {
   /**
@@ -174,6 +215,14 @@ static void InitializeOhifTags()
   ohifInstanceTags_[Orthanc::DicomTag(0x7053, 0x1009)] = TagInformation(DataType_Float, "70531009");  // Philips ActivityConcentrationScaleFactor
   ohifInstanceTags_[Orthanc::DicomTag(0x0009, 0x100d)] = TagInformation(DataType_String, "0009100d");  // GE PrivatePostInjectionDateTime
 
+  /**
+   * The tags are formatted once and for all, as the formatted tags
+   * index the JSON objects that are read for each instance.
+   **/
+  FormatKeys(ohifStudyTags_);
+  FormatKeys(ohifSeriesTags_);
+  FormatKeys(ohifInstanceTags_);
+
   for (TagsDictionary::const_iterator it = ohifStudyTags_.begin(); it != ohifStudyTags_.end(); ++it)
   {
     assert(allTags_.find(it->first) == allTags_.end() ||
@@ -264,17 +313,16 @@ public:
 };
 
 
+// "key" is the formatted tag to be read from "source"
 static bool ParseTagFromOrthanc(Json::Value& target,
-                                const Orthanc::DicomTag& tag,
+                                const std::string& key,
                                 const std::string& name,
                                 DataType type,
                                 const Json::Value& source)
 {
-  const std::string formattedTag = tag.Format();
-
-  if (source.isMember(formattedTag))
+  if (source.isMember(key))
   {
-    const Json::Value& value = source[formattedTag];
+    const Json::Value& value = source[key];
 
     /**
      * The cases below derive from "Toolbox::SimplifyDicomAsJson()"
@@ -364,25 +412,22 @@ static bool ParseTagFromOrthanc(Json::Value& target,
 }
 
 
-static bool EncodeOhifInstance(Json::Value& target,
-                               const std::string& instanceId)
+// "source" contains the tags of one instance, in the "?short" format
+static void EncodeOhifInstance(Json::Value& target,
+                               const Json::Value& source)
 {
-  Json::Value source;
-  if (!OrthancPlugins::RestApiGet(source, "/instances/" + instanceId + "/tags?short", false))
-  {
-    return false;
-  }
-  else if (source.type() != Json::objectValue)
+  if (source.type() != Json::objectValue)
   {
     throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
   }
   else
   {
+    target = Json::objectValue;
     target[KEY_VERSION] = static_cast<int>(METADATA_VERSION);
     
     for (TagsDictionary::const_iterator it = allTags_.begin(); it != allTags_.end(); ++it)
     {
-      ParseTagFromOrthanc(target, it->first, it->first.Format(), it->second.GetType(), source);
+      ParseTagFromOrthanc(target, it->second.GetKey(), it->second.GetKey(), it->second.GetType(), source);
     }
 
     /**
@@ -403,10 +448,10 @@ static bool EncodeOhifInstance(Json::Value& target,
           pharma[0].type() == Json::objectValue)
       {
         Json::Value info;
-        if (ParseTagFromOrthanc(info, RADIONUCLIDE_HALF_LIFE, "RadionuclideHalfLife", DataType_Float, pharma[0]) &&
-            ParseTagFromOrthanc(info, RADIONUCLIDE_TOTAL_DOSE, "RadionuclideTotalDose", DataType_Float, pharma[0]) &&
-            (ParseTagFromOrthanc(info, RADIOPHARMACEUTICAL_START_DATETIME, "RadiopharmaceuticalStartDateTime", DataType_String, pharma[0]) ||
-             ParseTagFromOrthanc(info, RADIOPHARMACEUTICAL_START_TIME, "RadiopharmaceuticalStartTime", DataType_String, pharma[0])))
+        if (ParseTagFromOrthanc(info, RADIONUCLIDE_HALF_LIFE.Format(), "RadionuclideHalfLife", DataType_Float, pharma[0]) &&
+            ParseTagFromOrthanc(info, RADIONUCLIDE_TOTAL_DOSE.Format(), "RadionuclideTotalDose", DataType_Float, pharma[0]) &&
+            (ParseTagFromOrthanc(info, RADIOPHARMACEUTICAL_START_DATETIME.Format(), "RadiopharmaceuticalStartDateTime", DataType_String, pharma[0]) ||
+             ParseTagFromOrthanc(info, RADIOPHARMACEUTICAL_START_TIME.Format(), "RadiopharmaceuticalStartTime", DataType_String, pharma[0])))
         {
           Json::Value sequence = Json::arrayValue;
           sequence.append(info);
@@ -415,6 +460,49 @@ static bool EncodeOhifInstance(Json::Value& target,
         }
       }
     }
+  }
+}
+
+
+static bool EncodeOhifInstance(Json::Value& target,
+                               const std::string& instanceId)
+{
+  Json::Value source;
+  if (OrthancPlugins::RestApiGet(source, "/instances/" + instanceId + "/tags?short", false))
+  {
+    EncodeOhifInstance(target, source);
+    return true;
+  }
+  else
+  {
+    return false;
+  }
+}
+
+
+// Encodes all the instances of one series using a single call to the
+// REST API. The target maps the Orthanc instance IDs to the OHIF tags.
+static bool EncodeOhifSeries(Json::Value& target,
+                             const std::string& seriesId)
+{
+  Json::Value source;
+  if (!OrthancPlugins::RestApiGet(source, "/series/" + seriesId + "/instances-tags?short", false))
+  {
+    return false;
+  }
+  else if (source.type() != Json::objectValue)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+  }
+  else
+  {
+    target = Json::objectValue;
+
+    const Json::Value::Members members = source.getMemberNames();
+    for (size_t i = 0; i < members.size(); i++)
+    {
+      EncodeOhifInstance(target[members[i]], source[members[i]]);
+    }
 
     return true;
   }
@@ -427,317 +515,4248 @@ static std::string GetCacheUri(const std::string& instanceId)
 }
 
 
-static void CacheAsMetadata(const Json::Value& instanceTags,
-                            const std::string& instanceId)
+static std::string GetSeriesCacheUri(const std::string& seriesId)
 {
-  std::string uncompressed;
-  Orthanc::Toolbox::WriteFastJson(uncompressed, instanceTags);
+  return "/series/" + seriesId + "/metadata/" + METADATA_OHIF;
+}
 
-  std::string compressed;
-  Orthanc::GzipCompressor compressor;
-  Orthanc::IBufferCompressor::Compress(compressed, compressor, uncompressed);
 
-  std::string metadata;
-  Orthanc::Toolbox::EncodeBase64(metadata, compressed);
+/**
+ * Orthanc signals an "UpdatedMetadata" change each time the plugin
+ * writes or removes its own "4202" metadata, but the change does not
+ * tell which metadata was updated. The plugin therefore records its
+ * own pending writes, so that the corresponding changes do not evict
+ * the caches that were just filled.
+ **/
+class SelfWrites : public boost::noncopyable
+{
+private:
+  typedef std::map<std::string, unsigned int>  Pending;  // Orthanc ID => number of writes whose change is not received yet
 
-  Json::Value answer;
-  OrthancPlugins::RestApiPut(answer, GetCacheUri(instanceId), metadata.c_str(), metadata.size(), false);
-}
+  boost::mutex  mutex_;
+  Pending       pending_;
 
+public:
+  void Register(const std::string& resourceId)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    pending_[resourceId]++;
+  }
 
-static bool GetOhifInstance(Json::Value& target,
-                            const std::string& instanceId)
-{
-  const std::string uri = GetCacheUri(instanceId);
-  
-  std::string metadata;
-  
-  if (OrthancPlugins::RestApiGetString(metadata, uri, false))
+  // To be called if the write has failed, in which case Orthanc
+  // signals no change
+  void Cancel(const std::string& resourceId)
   {
-    try
-    {
-      std::string compressed;
-      Orthanc::Toolbox::DecodeBase64(compressed, metadata);
+    Consume(resourceId);
+  }
 
-      std::string uncompressed;
-      Orthanc::GzipCompressor compressor;
-      Orthanc::IBufferCompressor::Uncompress(uncompressed, compressor, compressed);
+  // Returns "true" iff the change originates from the plugin
+  bool Consume(const std::string& resourceId)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
 
-      if (Orthanc::Toolbox::ReadJson(target, uncompressed) &&
-          target.isMember(KEY_VERSION) &&
-          target[KEY_VERSION].type() == Json::intValue &&
-          target[KEY_VERSION].asInt() == METADATA_VERSION)
-      {
-        // Success, we can reuse the cached value
-        return true;
-      }
-    }
-    catch (Orthanc::OrthancException&)
+    Pending::iterator found = pending_.find(resourceId);
+    if (found == pending_.end())
     {
+      return false;
     }
 
-    // Remove corrupted or metadata with an earlier version
-    OrthancPlugins::RestApiDelete(uri, false);
-  }
+    assert(found->second > 0);
+    found->second--;
+    if (found->second == 0)
+    {
+      pending_.erase(found);
+    }
 
-  if (EncodeOhifInstance(target, instanceId))
-  {
-    CacheAsMetadata(target, instanceId);
     return true;
   }
-  else
+
+  void Forget(const std::string& resourceId)
   {
-    return false;
+    boost::mutex::scoped_lock lock(mutex_);
+    pending_.erase(resourceId);
   }
-}
+};
 
 
-static ResourcesCache               cache_;
-static std::string                  userConfiguration_;
-static std::string                  routerBasename_;
-static DataSource                   dataSource_;
-static bool                         preload_;
-static boost::thread                metadataThread_;
-static Orthanc::SharedMessageQueue  pendingInstances_;
-static bool                         continueThread_;
+static SelfWrites  selfWrites_;
 
-void ServeFile(OrthancPluginRestOutput* output,
-               const char* url,
-               const OrthancPluginHttpRequest* request)
+
+/**
+ * Instances whose DICOM file was replaced, which makes their metadata
+ * in the record of their series outdated. Such a change is signaled
+ * on the thread of the changes of Orthanc, which must not call the
+ * REST API: The instances are only marked here, then encoded again by
+ * the preload workers, or by the next request for their study.
+ **/
+class OutdatedInstances : public boost::noncopyable
 {
-  OrthancPluginContext* context = OrthancPlugins::GetGlobalContext();
-  
-  // The next 3 HTTP headers are required to enable SharedArrayBuffer
-  // (https://web.dev/coop-coep/)
-  OrthancPluginSetHttpHeader(context, output, "Cross-Origin-Embedder-Policy", "require-corp");
-  OrthancPluginSetHttpHeader(context, output, "Cross-Origin-Opener-Policy", "same-origin");
-  OrthancPluginSetHttpHeader(context, output, "Cross-Origin-Resource-Policy", "same-origin");
+private:
+  boost::mutex           mutex_;
+  std::set<std::string>  content_;
 
-  std::string uri;
-  if (request->groupsCount > 0)
+public:
+  void Add(const std::string& instanceId)
   {
-    uri = request->groups[0];
+    boost::mutex::scoped_lock lock(mutex_);
+    content_.insert(instanceId);
   }
 
-  if (uri == "app-config.js")
+  void Remove(const std::string& instanceId)
   {
-    std::string system;
-    Orthanc::EmbeddedResources::GetFileResource(system, Orthanc::EmbeddedResources::APP_CONFIG_SYSTEM);
+    boost::mutex::scoped_lock lock(mutex_);
+    content_.erase(instanceId);
+  }
 
-    std::map<std::string, std::string> dictionary;
-    dictionary["ROUTER_BASENAME"] = routerBasename_;
-    dictionary["USE_DICOM_WEB"] = (dataSource_ == DataSource_DicomWeb ? "true" : "false");
+  bool Contains(const std::string& instanceId)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return content_.find(instanceId) != content_.end();
+  }
 
-    system = Orthanc::Toolbox::SubstituteVariables(system, dictionary);
+  // Adds to "target" the outdated instances among "instancesIds"
+  void Lookup(std::set<std::string>& target,
+              const std::list<std::string>& instancesIds)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
 
-    std::string s = (userConfiguration_ + "\n" + system);
-    OrthancPluginAnswerBuffer(context, output, s.c_str(), s.size(), "application/json");
+    if (!content_.empty())
+    {
+      for (std::list<std::string>::const_iterator it = instancesIds.begin(); it != instancesIds.end(); ++it)
+      {
+        if (content_.find(*it) != content_.end())
+        {
+          target.insert(*it);
+        }
+      }
+    }
   }
-  else if (uri == "" ||      // Study list
-           uri == "tmtv" ||  // Total metabolic tumor volume
-           uri == "viewer")  // Default viewer (including MPR)
+};
+
+
+static OutdatedInstances  outdatedInstances_;
+
+
+// Returns "false" if the metadata could not be written
+static bool PutMetadata(const std::string& resourceId,
+                        const std::string& uri,
+                        const std::string& metadata)
+{
+  selfWrites_.Register(resourceId);
+
+  Json::Value answer;
+  if (OrthancPlugins::RestApiPut(answer, uri, metadata.c_str(), metadata.size(), false))
   {
-    // Those correspond to the different modes of the OHIF platform:
-    // https://v3-docs.ohif.org/platform/modes/
-    cache_.Answer(context, output, "index.html");
+    return true;
   }
-  else 
+  else
   {
-    cache_.Answer(context, output, uri);
+    selfWrites_.Cancel(resourceId);
+    return false;
   }
 }
 
 
-static void GenerateOhifStudy(Json::Value& target,
-                              const std::string& studyId)
+static bool StoreAsMetadata(const std::string& resourceId,
+                            const std::string& uri,
+                            const Json::Value& value)
 {
-  // https://v3-docs.ohif.org/configuration/dataSources/dicom-json
-  static const char* const KEY_ID = "ID";
-  const std::string KEY_PATIENT_ID = Orthanc::DICOM_TAG_PATIENT_ID.Format();
-  const std::string KEY_STUDY_INSTANCE_UID = Orthanc::DICOM_TAG_STUDY_INSTANCE_UID.Format();
-  const std::string KEY_SERIES_INSTANCE_UID = Orthanc::DICOM_TAG_SERIES_INSTANCE_UID.Format();
-  const std::string KEY_SOP_INSTANCE_UID = Orthanc::DICOM_TAG_SOP_INSTANCE_UID.Format();
-  
-  Json::Value instancesIds;
-  if (!OrthancPlugins::RestApiGet(instancesIds, "/studies/" + studyId + "/instances", false))
-  {
-    throw Orthanc::OrthancException(Orthanc::ErrorCode_UnknownResource);
-  }
+  std::string uncompressed;
+  Orthanc::Toolbox::WriteFastJson(uncompressed, value);
+
+  std::string compressed;
+  Orthanc::GzipCompressor compressor;
+  Orthanc::IBufferCompressor::Compress(compressed, compressor, uncompressed);
+
+  std::string metadata;
+  Orthanc::Toolbox::EncodeBase64(metadata, compressed);
+
+  return PutMetadata(resourceId, uri, metadata);
+}
+
 
-  if (instancesIds.type() != Json::arrayValue)
+static void DeleteMetadata(const std::string& resourceId,
+                           const std::string& uri)
+{
+  selfWrites_.Register(resourceId);
+
+  if (!OrthancPlugins::RestApiDelete(uri, false))
   {
-    throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+    selfWrites_.Cancel(resourceId);
   }
+}
 
-  std::vector<Json::Value> instancesTags;
-  instancesTags.reserve(instancesIds.size());
 
-  for (Json::ArrayIndex i = 0; i < instancesIds.size(); i++)
+// Returns "false" if the metadata is corrupted or has an earlier version
+static bool DecodeOhifMetadata(Json::Value& target,
+                               const std::string& metadata)
+{
+  try
   {
-    if (instancesIds[i].type() != Json::objectValue ||
-        !instancesIds[i].isMember(KEY_ID) ||
-        instancesIds[i][KEY_ID].type() != Json::stringValue)
-    {
-      throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
-    }
+    std::string compressed;
+    Orthanc::Toolbox::DecodeBase64(compressed, metadata);
 
-    Json::Value t;
-    if (GetOhifInstance(t, instancesIds[i][KEY_ID].asString()))
-    {
-      instancesTags.push_back(t);
-    }
+    std::string uncompressed;
+    Orthanc::GzipCompressor compressor;
+    Orthanc::IBufferCompressor::Uncompress(uncompressed, compressor, compressed);
+
+    return (Orthanc::Toolbox::ReadJson(target, uncompressed) &&
+            target.isMember(KEY_VERSION) &&
+            target[KEY_VERSION].type() == Json::intValue &&
+            target[KEY_VERSION].asInt() == METADATA_VERSION);
+  }
+  catch (Orthanc::OrthancException&)
+  {
+    return false;
   }
+}
+
 
-  typedef std::list<const Json::Value*>           ListOfResources;
-  typedef std::map<std::string, ListOfResources>  MapOfResources;
+static PreloadQueue        pendingInstances_(MAX_INSTANCES_IN_QUEUE);
+static FetchPool           fetchPool_;
+static SeriesRecordsCache  seriesRecords_(SERIES_RECORDS_CACHE_SHARDS);
 
-  MapOfResources studies;
-  for (Json::ArrayIndex i = 0; i < instancesTags.size(); i++)
+
+/**
+ * Gets the OHIF metadata of one instance that is not part of the
+ * record of its parent series. The "4202" metadata of individual
+ * instances was created by earlier versions of the plugin, and is
+ * only read for backward compatibility: The caller is responsible for
+ * merging the result into the record of the series.
+ **/
+static bool GetOhifInstance(Json::Value& target,
+                            const std::string& instanceId)
+{
+  const std::string uri = GetCacheUri(instanceId);
+  
+  std::string metadata;
+  
+  if (OrthancPlugins::RestApiGetString(metadata, uri, false))
   {
-    if (instancesTags[i].isMember(KEY_STUDY_INSTANCE_UID))
+    if (DecodeOhifMetadata(target, metadata))
     {
-      if (instancesTags[i][KEY_STUDY_INSTANCE_UID].type() != Json::stringValue)
-      {
-        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
-      }
-      else
-      {
-        const std::string& studyInstanceUid = instancesTags[i][KEY_STUDY_INSTANCE_UID].asString();
-        studies[studyInstanceUid].push_back(&instancesTags[i]);
-      }
+      // Success, we can reuse the cached value
+      return true;
     }
+
+    // Remove corrupted or metadata with an earlier version
+    DeleteMetadata(instanceId, uri);
   }
 
-  target["studies"] = Json::arrayValue;
-  
-  for (MapOfResources::const_iterator it = studies.begin(); it != studies.end(); ++it)
-  {
-    if (!it->second.empty())
-    {
-      assert(it->second.front() != NULL);
-      const Json::Value& firstInstanceInStudy = *it->second.front();
-      
-      Json::Value study = Json::objectValue;
-      for (TagsDictionary::const_iterator tag = ohifStudyTags_.begin(); tag != ohifStudyTags_.end(); ++tag)
-      {
-        if (firstInstanceInStudy.isMember(tag->first.Format()))
-        {
-          study[tag->second.GetName()] = firstInstanceInStudy[tag->first.Format()];
-        }
-      }
+  return EncodeOhifInstance(target, instanceId);
+}
 
-      MapOfResources seriesInStudy;
-      for (ListOfResources::const_iterator it2 = it->second.begin(); it2 != it->second.end(); ++it2)
-      {
-        assert(*it2 != NULL);
-        const Json::Value& instanceInStudy = **it2;
-        
-        if (instanceInStudy.isMember(KEY_SERIES_INSTANCE_UID))
-        {
-          if (instanceInStudy[KEY_SERIES_INSTANCE_UID].type() != Json::stringValue)
-          {
-            throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
-          }
-          else
-          {
-            const std::string& seriesInstanceUid = instanceInStudy[KEY_SERIES_INSTANCE_UID].asString();
-            seriesInStudy[seriesInstanceUid].push_back(&instanceInStudy);
-          }
-        }
-      }
 
-      study["series"] = Json::arrayValue;
+/**
+ * The OHIF metadata of all the instances of one series is stored as
+ * a single "4202" metadata attached to the series (the "record" of
+ * the series), which allows to write the metadata of a batch of
+ * instances at once. The read-modify-write cycles on the records are
+ * serialized by a pool of mutexes indexed by the series.
+ **/
+static boost::mutex  seriesMutexes_[SERIES_MUTEXES];
 
-      for (MapOfResources::const_iterator it3 = seriesInStudy.begin(); it3 != seriesInStudy.end(); ++it3)
-      {
-        if (!it3->second.empty())
-        {
-          assert(it3->second.front() != NULL);
-          const Json::Value& firstInstanceInSeries = *it3->second.front();
 
-          Json::Value series = Json::objectValue;
-          for (TagsDictionary::const_iterator tag = ohifSeriesTags_.begin(); tag != ohifSeriesTags_.end(); ++tag)
-          {
-            if (firstInstanceInSeries.isMember(tag->first.Format()))
-            {
-              series[tag->second.GetName()] = firstInstanceInSeries[tag->first.Format()];
-            }
-          }
+static boost::mutex& GetSeriesMutex(const std::string& seriesId)
+{
+  return seriesMutexes_[boost::hash<std::string>()(seriesId) % SERIES_MUTEXES];
+}
 
-          series["instances"] = Json::arrayValue;
 
-          for (ListOfResources::const_iterator it4 = it3->second.begin(); it4 != it3->second.end(); ++it4)
-          {
-            assert(*it4 != NULL);
-            const Json::Value& instanceInSeries = **it4;
+static const char* const  KEY_VALUES = "Values";
+static const char* const  KEY_INTERNED = "Interned";
 
-            Json::Value metadata;
-            for (TagsDictionary::const_iterator tag = ohifInstanceTags_.begin(); tag != ohifInstanceTags_.end(); ++tag)
-            {
-              if (instanceInSeries.isMember(tag->first.Format()))
-              {
-                metadata[tag->second.GetName()] = instanceInSeries[tag->first.Format()];
-              }
-            }
 
-            Orthanc::DicomInstanceHasher hasher(instanceInSeries[KEY_PATIENT_ID].asString(),
-                                                instanceInSeries[KEY_STUDY_INSTANCE_UID].asString(),
-                                                instanceInSeries[KEY_SERIES_INSTANCE_UID].asString(),
-                                                instanceInSeries[KEY_SOP_INSTANCE_UID].asString());
+/**
+ * In the record of a series, the values of the tags are interned:
+ * Each distinct value is stored once in the "Values" array, and the
+ * tags of the instances reference their value by its index in this
+ * array. The values that are shared by the instances of the series
+ * (e.g. the UIDs, the modality or the frame of reference) are thus
+ * only stored and parsed once.
+ **/
+static void InternSeriesRecord(Json::Value& record,
+                               const Json::Value& instances)
+{
+  typedef std::map<Json::Value, Json::ArrayIndex>  Index;
+
+  Index index;
+  Json::Value values = Json::arrayValue;
+  Json::Value interned = Json::objectValue;
 
-            Json::Value instance = Json::objectValue;
-            instance["metadata"] = metadata;
-            instance["url"] = "dicomweb:../instances/" + hasher.HashInstance() + "/file";
+  const Json::Value::Members ids = instances.getMemberNames();
+  for (size_t i = 0; i < ids.size(); i++)
+  {
+    const Json::Value& source = instances[ids[i]];
+    Json::Value& target = interned[ids[i]];
+    target = Json::objectValue;
 
-            series["instances"].append(instance);
-          }
+    const Json::Value::Members tags = source.getMemberNames();
+    for (size_t j = 0; j < tags.size(); j++)
+    {
+      const Json::Value& value = source[tags[j]];
 
-          study["series"].append(series);
-        }
+      Index::const_iterator found = index.find(value);
+      if (found == index.end())
+      {
+        found = index.insert(std::make_pair(value, values.size())).first;
+        values.append(value);
       }
 
-      target["studies"].append(study);
+      target[tags[j]] = found->second;
     }
-  }  
+  }
+
+  record[KEY_VALUES].swap(values);
+  record[KEY_INTERNED].swap(interned);
+}
+
+
+static bool ExpandSeriesRecord(Json::Value& target,
+                               const Json::Value& record)
+{
+  const Json::Value& values = record[KEY_VALUES];
+  const Json::Value& interned = record[KEY_INTERNED];
+
+  if (values.type() != Json::arrayValue ||
+      interned.type() != Json::objectValue)
+  {
+    return false;
+  }
+
+  target = Json::objectValue;
+
+  const Json::Value::Members ids = interned.getMemberNames();
+  for (size_t i = 0; i < ids.size(); i++)
+  {
+    const Json::Value& source = interned[ids[i]];
+    if (source.type() != Json::objectValue)
+    {
+      return false;
+    }
+
+    Json::Value& instance = target[ids[i]];
+    instance = Json::objectValue;
+
+    const Json::Value::Members tags = source.getMemberNames();
+    for (size_t j = 0; j < tags.size(); j++)
+    {
+      const Json::Value& index = source[tags[j]];
+      if (!index.isUInt() ||
+          index.asUInt() >= values.size())
+      {
+        return false;
+      }
+
+      instance[tags[j]] = values[index.asUInt()];
+    }
+  }
+
+  return true;
+}
+
+
+// Returns "false" if the record is missing, corrupted, or has an
+// earlier version. The target maps the Orthanc instance IDs to the
+// OHIF tags.
+static bool ReadSeriesRecord(Json::Value& target,
+                             const std::string& seriesId)
+{
+  uint64_t revision;
+  if (seriesRecords_.Lookup(target, revision, seriesId))
+  {
+    return true;
+  }
+
+  std::string metadata;
+  Json::Value record;
+  
+  if (OrthancPlugins::RestApiGetString(metadata, GetSeriesCacheUri(seriesId), false) &&
+      DecodeOhifMetadata(record, metadata) &&
+      ExpandSeriesRecord(target, record))
+  {
+    seriesRecords_.StoreRead(seriesId, target, revision);
+    return true;
+  }
+  else
+  {
+    return false;
+  }
+}
+
+
+// The mutex of the series must be locked
+static void WriteSeriesRecord(const std::string& seriesId,
+                              const Json::Value& instances)
+{
+  Json::Value record = Json::objectValue;
+  record[KEY_VERSION] = static_cast<int>(METADATA_VERSION);
+  InternSeriesRecord(record, instances);
+
+  if (StoreAsMetadata(seriesId, GetSeriesCacheUri(seriesId), record))
+  {
+    seriesRecords_.StoreWritten(seriesId, instances);
+  }
+  else
+  {
+    seriesRecords_.Invalidate(seriesId);
+  }
+}
+
+
+// Adds the given instances to the record of the series, and removes
+// the instances that were deleted or whose DICOM file was replaced
+static void MergeIntoSeriesRecord(const std::string& seriesId,
+                                  const Json::Value& instances,
+                                  const std::set<std::string>& removed)
+{
+  boost::mutex::scoped_lock lock(GetSeriesMutex(seriesId));
+
+  Json::Value record;
+  if (!ReadSeriesRecord(record, seriesId))
+  {
+    record = Json::objectValue;
+  }
+
+  bool modified = false;
+
+  for (std::set<std::string>::const_iterator it = removed.begin(); it != removed.end(); ++it)
+  {
+    if (record.isMember(*it))
+    {
+      record.removeMember(*it);
+      modified = true;
+    }
+  }
+
+  const Json::Value::Members members = instances.getMemberNames();
+  for (size_t i = 0; i < members.size(); i++)
+  {
+    record[members[i]] = instances[members[i]];
+    modified = true;
+  }
+
+  if (modified)
+  {
+    WriteSeriesRecord(seriesId, record);
+  }
+}
+
+
+/**
+ * Write-behind buffer of the OHIF metadata that was computed by the
+ * preload workers, but that is not stored yet in the record of its
+ * parent series. Rewriting the record after each incoming instance
+ * would be quadratic in the size of the series, so a series is only
+ * flushed once it is stable (which is signaled through the preload
+ * queue), once enough of its instances are pending, or once its
+ * oldest pending instance is too old. The spill log of the preload
+ * queue is kept until this buffer is flushed.
+ **/
+class PendingSeriesRecords : public PreloadQueue::IWriteBehindBuffer
+{
+private:
+  struct Series
+  {
+    Json::Value               instances_;  // Orthanc instance ID => OHIF tags
+    boost::posix_time::ptime  since_;
+    uint64_t                  oldest_;     // Mark of the oldest pending instance
+  };
+
+  typedef std::map<std::string, Series>  Content;  // Orthanc series ID => pending instances
+
+  boost::mutex             mutex_;
+  Content                  content_;
+  uint64_t                 added_;     // Number of calls to "Add()"
+  std::multiset<uint64_t>  flushing_;  // Oldest marks of the extractions whose content is not stored yet
+
+  // Extracts one series whose content will be stored by the caller
+  void Extract(std::map<std::string, Json::Value>& target,
+               uint64_t& oldest,
+               Content::iterator series)
+  {
+    // The mutex must be locked
+    if (!series->second.instances_.empty())
+    {
+      target[series->first].swap(series->second.instances_);
+      oldest = std::min(oldest, series->second.oldest_);
+    }
+
+    content_.erase(series);
+  }
+
+public:
+  PendingSeriesRecords() :
+    added_(0)
+  {
+  }
+
+  virtual uint64_t GetAddedMark()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return added_;
+  }
+
+  virtual bool IsStored(uint64_t mark)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (!flushing_.empty() &&
+        *flushing_.begin() <= mark)
+    {
+      return false;
+    }
+
+    for (Content::const_iterator it = content_.begin(); it != content_.end(); ++it)
+    {
+      if (it->second.oldest_ <= mark)
+      {
+        return false;
+      }
+    }
+
+    return true;
+  }
+
+  // Must be called once the content that was extracted by "Extract()"
+  // or "ExtractReady()" is stored, with the mark they returned
+  void EndFlush(uint64_t mark)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    std::multiset<uint64_t>::iterator found = flushing_.find(mark);
+    assert(found != flushing_.end());
+    flushing_.erase(found);
+  }
+
+  void Add(const std::string& seriesId,
+           const std::string& instanceId,
+           const Json::Value& instanceTags)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    added_++;
+
+    Series& series = content_[seriesId];
+    if (series.instances_.type() != Json::objectValue)
+    {
+      series.instances_ = Json::objectValue;
+      series.since_ = boost::posix_time::microsec_clock::universal_time();
+      series.oldest_ = added_;
+    }
+
+    series.instances_[instanceId] = instanceTags;
+  }
+
+  void RemoveInstance(const std::string& instanceId)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    for (Content::iterator it = content_.begin(); it != content_.end(); ++it)
+    {
+      it->second.instances_.removeMember(instanceId);
+    }
+  }
+
+  // Adds the pending instances of the given series to "target"
+  void Lookup(Json::Value& target,
+              const std::string& seriesId)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Content::const_iterator found = content_.find(seriesId);
+    if (found != content_.end())
+    {
+      const Json::Value::Members members = found->second.instances_.getMemberNames();
+      for (size_t i = 0; i < members.size(); i++)
+      {
+        target[members[i]] = found->second.instances_[members[i]];
+      }
+    }
+  }
+
+  // Returns the mark to be given to "EndFlush()"
+  uint64_t Extract(std::map<std::string, Json::Value>& target,
+                   const std::string& seriesId)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    uint64_t oldest = std::numeric_limits<uint64_t>::max();
+
+    Content::iterator found = content_.find(seriesId);
+    if (found != content_.end())
+    {
+      Extract(target, oldest, found);
+    }
+
+    flushing_.insert(oldest);
+    return oldest;
+  }
+
+  // Returns the number of milliseconds before the oldest series must
+  // be flushed, or zero if no series is pending
+  int32_t GetFlushTimeout()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (content_.empty())
+    {
+      return 0;
+    }
+
+    boost::posix_time::ptime oldest = content_.begin()->second.since_;
+    for (Content::const_iterator it = content_.begin(); it != content_.end(); ++it)
+    {
+      oldest = std::min(oldest, it->second.since_);
+    }
+
+    const int64_t elapsed = (boost::posix_time::microsec_clock::universal_time() - oldest).total_milliseconds();
+    return static_cast<int32_t>(std::max(static_cast<int64_t>(1),
+                                         static_cast<int64_t>(SERIES_FLUSH_DELAY) * 1000 - elapsed));
+  }
+
+  // The series was deleted, so its pending instances are dropped
+  void Discard(const std::string& seriesId)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    content_.erase(seriesId);
+  }
+
+  // Extracts the series that must be flushed (all of them if "all" is
+  // "true"). Returns the mark to be given to "EndFlush()".
+  uint64_t ExtractReady(std::map<std::string, Json::Value>& target,
+                        bool all)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    uint64_t oldest = std::numeric_limits<uint64_t>::max();
+
+    const boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+
+    Content::iterator it = content_.begin();
+    while (it != content_.end())
+    {
+      if (all ||
+          it->second.instances_.size() >= SERIES_FLUSH_SIZE ||
+          (now - it->second.since_).total_seconds() >= static_cast<int>(SERIES_FLUSH_DELAY))
+      {
+        Extract(target, oldest, it++);
+      }
+      else
+      {
+        ++it;
+      }
+    }
+
+    flushing_.insert(oldest);
+    return oldest;
+  }
+};
+
+
+static PendingSeriesRecords  pendingSeries_;
+
+
+static void StorePendingSeries(const std::map<std::string, Json::Value>& ready)
+{
+  for (std::map<std::string, Json::Value>::const_iterator it = ready.begin(); it != ready.end(); ++it)
+  {
+    try
+    {
+      MergeIntoSeriesRecord(it->first, it->second, std::set<std::string>());
+    }
+    catch (Orthanc::OrthancException& e)
+    {
+      // The series might have been deleted in the meantime
+      LOG(INFO) << "Cannot store the OHIF metadata of series " << it->first << ": " << e.What();
+    }
+  }
+}
+
+
+static void FlushPendingSeries(bool all)
+{
+  std::map<std::string, Json::Value> ready;
+  const uint64_t mark = pendingSeries_.ExtractReady(ready, all);
+  StorePendingSeries(ready);
+  pendingSeries_.EndFlush(mark);
+}
+
+
+static void FlushPendingSeries(const std::string& seriesId)
+{
+  std::map<std::string, Json::Value> ready;
+  const uint64_t mark = pendingSeries_.Extract(ready, seriesId);
+  StorePendingSeries(ready);
+  pendingSeries_.EndFlush(mark);
+}
+
+
+static std::string GetGlobalProperty(int32_t property)
+{
+  OrthancPlugins::OrthancString value;
+  value.Assign(OrthancPluginGetGlobalProperty(OrthancPlugins::GetGlobalContext(), property, ""));
+
+  std::string s;
+  value.ToString(s);
+  return s;
+}
+
+
+static void SetGlobalProperty(int32_t property,
+                              const std::string& value)
+{
+  OrthancPluginErrorCode code = OrthancPluginSetGlobalProperty(OrthancPlugins::GetGlobalContext(), property, value.c_str());
+  if (code != OrthancPluginErrorCode_Success)
+  {
+    throw Orthanc::OrthancException(static_cast<Orthanc::ErrorCode>(code));
+  }
+}
+
+
+static bool IsMetadataUpgradeNeeded()
+{
+  return GetGlobalProperty(GLOBAL_PROPERTY_METADATA_VERSION) != boost::lexical_cast<std::string>(METADATA_VERSION);
+}
+
+
+// The background jobs give way to the studies that are requested by
+// the viewer. Returns "true" if the caller must yield.
+static bool YieldToViewer()
+{
+  if (pendingInstances_.GetSize(PreloadPriority_High) > 0)
+  {
+    boost::this_thread::sleep(boost::posix_time::milliseconds(100));
+    return true;
+  }
+  else
+  {
+    return false;
+  }
+}
+
+
+#if HAS_ORTHANC_PLUGIN_JOB == 1
+/**
+ * Job that walks all the series stored by Orthanc, and that
+ * re-encodes the "4202" records that are corrupted or that were
+ * created by an earlier version of the plugin (i.e. whose version
+ * differs from "METADATA_VERSION"). This avoids re-encoding such
+ * metadata inline in the REST callbacks after an upgrade. The job
+ * only re-encodes the records of the series: The legacy "4202"
+ * metadata of individual instances is not touched, and relies on the
+ * on-the-fly path, which re-encodes it when its study is opened.
+ **/
+class MetadataUpgradeJob : public OrthancPlugins::OrthancJob
+{
+private:
+  static const unsigned int BATCH_SIZE = 10;
+  static const unsigned int CHANGES_BATCH_SIZE = 1000;
+  static const unsigned int MAX_PASSES = 3;
+
+  unsigned int  rate_;  // Maximum number of re-encoded instances per second, 0 means no limit
+  unsigned int  since_;
+  unsigned int  total_;
+  unsigned int  upgraded_;
+  unsigned int  pass_;
+  int64_t       passStart_;  // Last change of Orthanc when the current pass started
+
+  static int64_t GetLastChange()
+  {
+    Json::Value changes;
+    if (OrthancPlugins::RestApiGet(changes, "/changes?last", false) &&
+        changes.type() == Json::objectValue &&
+        changes.isMember("Last") &&
+        changes["Last"].isInt64())
+    {
+      return changes["Last"].asInt64();
+    }
+    else
+    {
+      return 0;  // The whole log of changes will be checked
+    }
+  }
+
+  // The series are listed by offset, so a series that is deleted
+  // during a pass shifts the next ones, one of which is then skipped.
+  // Tells whether a patient, a study or a series was deleted since
+  // the given change.
+  static bool HasDeletedSeries(int64_t since)
+  {
+    for (;;)
+    {
+      Json::Value changes;
+      if (!OrthancPlugins::RestApiGet(changes, "/changes?since=" + boost::lexical_cast<std::string>(since) +
+                                      "&limit=" + boost::lexical_cast<std::string>(CHANGES_BATCH_SIZE), false) ||
+          changes.type() != Json::objectValue ||
+          !changes.isMember("Changes") ||
+          !changes.isMember("Done") ||
+          !changes.isMember("Last") ||
+          changes["Changes"].type() != Json::arrayValue ||
+          changes["Done"].type() != Json::booleanValue ||
+          !changes["Last"].isInt64())
+      {
+        return true;  // Cannot check, assume the worst
+      }
+
+      for (Json::Value::ArrayIndex i = 0; i < changes["Changes"].size(); i++)
+      {
+        const Json::Value& change = changes["Changes"][i];
+        if (change.type() == Json::objectValue &&
+            change.isMember("ChangeType") &&
+            change.isMember("ResourceType") &&
+            change["ChangeType"].type() == Json::stringValue &&
+            change["ResourceType"].type() == Json::stringValue &&
+            change["ChangeType"].asString() == "Deleted" &&
+            change["ResourceType"].asString() != "Instance")
+        {
+          return true;
+        }
+      }
+
+      if (changes["Done"].asBool() ||
+          changes["Last"].asInt64() <= since)
+      {
+        return false;
+      }
+
+      since = changes["Last"].asInt64();
+    }
+  }
+
+  void StartPass()
+  {
+    // The log of changes is read before listing the first series
+    passStart_ = GetLastChange();
+    since_ = 0;
+  }
+
+  void UpdateState()
+  {
+    Json::Value content = Json::objectValue;
+    content["Pass"] = pass_ + 1;
+    content["Processed"] = since_;
+    content["Total"] = total_;
+    content["Upgraded"] = upgraded_;
+    content["MetadataVersion"] = static_cast<int>(METADATA_VERSION);
+    UpdateContent(content);
+
+    if (total_ == 0)
+    {
+      UpdateProgress(0);
+    }
+    else
+    {
+      UpdateProgress(std::min(1.0f, static_cast<float>(since_) / static_cast<float>(total_)));
+    }
+  }
+
+  // Returns the number of re-encoded instances
+  unsigned int UpgradeSeries(const std::string& seriesId)
+  {
+    std::string metadata;
+    Json::Value record;
+    
+    if (OrthancPlugins::RestApiGetString(metadata, GetSeriesCacheUri(seriesId), false) &&
+        !DecodeOhifMetadata(record, metadata))
+    {
+      boost::mutex::scoped_lock lock(GetSeriesMutex(seriesId));
+
+      Json::Value instances;
+      if (EncodeOhifSeries(instances, seriesId))
+      {
+        WriteSeriesRecord(seriesId, instances);
+      }
+      else
+      {
+        DeleteMetadata(seriesId, GetSeriesCacheUri(seriesId));
+        seriesRecords_.Invalidate(seriesId);
+      }
+
+      upgraded_++;
+      return instances.size();
+    }
+    else
+    {
+      return 0;
+    }
+  }
+
+public:
+  explicit MetadataUpgradeJob(unsigned int rate) :
+    OrthancJob("OhifMetadataUpgrade"),
+    rate_(rate),
+    since_(0),
+    total_(0),
+    upgraded_(0),
+    pass_(0),
+    passStart_(0)
+  {
+    Reset();
+  }
+
+  virtual OrthancPluginJobStepStatus Step()
+  {
+    if (YieldToViewer())
+    {
+      return OrthancPluginJobStepStatus_Continue;
+    }
+
+    const boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+
+    Json::Value series;
+    if (!OrthancPlugins::RestApiGet(series, "/series?since=" + boost::lexical_cast<std::string>(since_) +
+                                    "&limit=" + boost::lexical_cast<std::string>(BATCH_SIZE), false) ||
+        series.type() != Json::arrayValue)
+    {
+      return OrthancPluginJobStepStatus_Failure;
+    }
+
+    if (series.size() == 0)
+    {
+      if (!HasDeletedSeries(passStart_))
+      {
+        LOG(WARNING) << "The OHIF metadata was upgraded to version " << METADATA_VERSION
+                     << " (" << upgraded_ << " series were re-encoded)";
+        SetGlobalProperty(GLOBAL_PROPERTY_METADATA_VERSION, boost::lexical_cast<std::string>(METADATA_VERSION));
+      }
+      else if (pass_ + 1 < MAX_PASSES)
+      {
+        // Some series might have been skipped: Verify all of them
+        // again, which is fast for the series that are up-to-date
+        LOG(INFO) << "Series were deleted during the upgrade of the OHIF metadata, starting another pass";
+        pass_++;
+        StartPass();
+        UpdateState();
+        return OrthancPluginJobStepStatus_Continue;
+      }
+      else
+      {
+        // The version is not stored, so the upgrade will run again
+        // on the next startup of Orthanc
+        LOG(WARNING) << "Series kept being deleted during the upgrade of the OHIF metadata to version "
+                     << METADATA_VERSION << ", which will be checked again on the next startup ("
+                     << upgraded_ << " series were re-encoded)";
+      }
+
+      since_ = total_;
+      UpdateState();
+      return OrthancPluginJobStepStatus_Success;
+    }
+
+    unsigned int encoded = 0;
+
+    for (Json::Value::ArrayIndex i = 0; i < series.size(); i++)
+    {
+      if (series[i].type() == Json::stringValue)
+      {
+        try
+        {
+          encoded += UpgradeSeries(series[i].asString());
+        }
+        catch (Orthanc::OrthancException& e)
+        {
+          // The series might have been deleted in the meantime
+          LOG(INFO) << "Cannot upgrade the OHIF metadata of series " << series[i].asString() << ": " << e.What();
+        }
+      }
+    }
+
+    since_ += series.size();
+    total_ = std::max(total_, since_);
+    UpdateState();
+
+    if (rate_ != 0)
+    {
+      // Throttle the job so as not to overwhelm Orthanc
+      const int64_t expected = static_cast<int64_t>(encoded) * 1000 / rate_;
+      const int64_t elapsed = (boost::posix_time::microsec_clock::universal_time() - start).total_milliseconds();
+      
+      if (elapsed < expected)
+      {
+        boost::this_thread::sleep(boost::posix_time::milliseconds(expected - elapsed));
+      }
+    }
+
+    return OrthancPluginJobStepStatus_Continue;
+  }
+
+  virtual void Stop(OrthancPluginJobStopReason /* reason */)
+  {
+  }
+
+  virtual void Reset()
+  {
+    upgraded_ = 0;
+    pass_ = 0;
+    StartPass();
+
+    Json::Value statistics;
+    if (OrthancPlugins::RestApiGet(statistics, "/statistics", false) &&
+        statistics.type() == Json::objectValue &&
+        statistics.isMember("CountSeries") &&
+        statistics["CountSeries"].isUInt())
+    {
+      total_ = statistics["CountSeries"].asUInt();
+    }
+    else
+    {
+      total_ = 0;
+    }
+
+    UpdateState();
+  }
+};
+
+
+
+/**
+ * Job that walks the log of changes of Orthanc, in order to complete
+ * the "4202" records of the series that were received while the
+ * preload thread was not running (e.g. before the plugin was
+ * installed, or if the preload queue was full). The last processed
+ * change is stored as a global property, so that the job resumes
+ * from this checkpoint after a restart of Orthanc.
+ **/
+class MetadataBackfillJob : public OrthancPlugins::OrthancJob
+{
+private:
+  static const unsigned int BATCH_SIZE = 1000;
+
+  unsigned int  threadsCount_;
+  int64_t       start_;
+  int64_t       checkpoint_;
+  int64_t       last_;
+  unsigned int  filled_;
+
+  class Worker : public boost::noncopyable
+  {
+  private:
+    const std::vector<std::string>&  series_;
+    boost::mutex                     mutex_;
+    size_t                           next_;
+    unsigned int                     filled_;
+
+    bool GetNextSeries(std::string& seriesId)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      if (next_ < series_.size())
+      {
+        seriesId = series_[next_];
+        next_++;
+        return true;
+      }
+      else
+      {
+        return false;
+      }
+    }
+
+    // Returns "true" iff the record of the series was completed
+    static bool FillSeries(const std::string& seriesId)
+    {
+      Json::Value series;
+      if (!OrthancPlugins::RestApiGet(series, "/series/" + seriesId, false) ||
+          series.type() != Json::objectValue ||
+          !series.isMember(KEY_INSTANCES) ||
+          series[KEY_INSTANCES].type() != Json::arrayValue)
+      {
+        return false;  // The series was deleted in the meantime
+      }
+
+      Json::Value record;
+      if (ReadSeriesRecord(record, seriesId))
+      {
+        bool complete = true;
+        
+        for (Json::Value::ArrayIndex i = 0; i < series[KEY_INSTANCES].size() && complete; i++)
+        {
+          if (series[KEY_INSTANCES][i].type() != Json::stringValue ||
+              !record.isMember(series[KEY_INSTANCES][i].asString()))
+          {
+            complete = false;
+          }
+        }
+
+        if (complete)
+        {
+          return false;
+        }
+      }
+
+      // The record is rebuilt while holding the mutex of the series,
+      // so that it also contains the instances that might have been
+      // flushed by the preload workers in the meantime
+      boost::mutex::scoped_lock lock(GetSeriesMutex(seriesId));
+
+      Json::Value instances;
+      if (EncodeOhifSeries(instances, seriesId))
+      {
+        WriteSeriesRecord(seriesId, instances);
+        return true;
+      }
+      else
+      {
+        return false;
+      }
+    }
+
+  public:
+    explicit Worker(const std::vector<std::string>& series) :
+      series_(series),
+      next_(0),
+      filled_(0)
+    {
+    }
+
+    unsigned int GetFilledCount() const
+    {
+      return filled_;
+    }
+
+    void Run()
+    {
+      std::string seriesId;
+      while (GetNextSeries(seriesId))
+      {
+        try
+        {
+          if (FillSeries(seriesId))
+          {
+            boost::mutex::scoped_lock lock(mutex_);
+            filled_++;
+          }
+        }
+        catch (Orthanc::OrthancException& e)
+        {
+          // The series might have been deleted in the meantime
+          LOG(INFO) << "Cannot backfill the OHIF metadata of series " << seriesId << ": " << e.What();
+        }
+      }
+    }
+  };
+
+  void UpdateState()
+  {
+    Json::Value content = Json::objectValue;
+    content["Checkpoint"] = static_cast<Json::Int64>(checkpoint_);
+    content["Last"] = static_cast<Json::Int64>(last_);
+    content["Filled"] = filled_;
+    UpdateContent(content);
+
+    if (last_ <= start_)
+    {
+      UpdateProgress(0);
+    }
+    else
+    {
+      UpdateProgress(std::min(1.0f, static_cast<float>(checkpoint_ - start_) / static_cast<float>(last_ - start_)));
+    }
+  }
+
+public:
+  explicit MetadataBackfillJob(unsigned int threadsCount) :
+    OrthancJob("OhifMetadataBackfill"),
+    threadsCount_(std::max(1u, threadsCount)),
+    start_(0),
+    checkpoint_(0),
+    last_(0),
+    filled_(0)
+  {
+    Reset();
+  }
+
+  virtual OrthancPluginJobStepStatus Step()
+  {
+    if (YieldToViewer())
+    {
+      return OrthancPluginJobStepStatus_Continue;
+    }
+
+    Json::Value changes;
+    if (!OrthancPlugins::RestApiGet(changes, "/changes?since=" + boost::lexical_cast<std::string>(checkpoint_) +
+                                    "&limit=" + boost::lexical_cast<std::string>(BATCH_SIZE), false) ||
+        changes.type() != Json::objectValue ||
+        !changes.isMember("Changes") ||
+        !changes.isMember("Done") ||
+        !changes.isMember("Last") ||
+        changes["Changes"].type() != Json::arrayValue ||
+        changes["Done"].type() != Json::booleanValue ||
+        !changes["Last"].isInt64())
+    {
+      return OrthancPluginJobStepStatus_Failure;
+    }
+
+    // A "StableSeries" change is generated after the last instance
+    // of a series is received, which covers the instances that are
+    // added to an existing series
+    std::set<std::string> uniqueSeries;
+
+    for (Json::Value::ArrayIndex i = 0; i < changes["Changes"].size(); i++)
+    {
+      const Json::Value& change = changes["Changes"][i];
+      if (change.type() == Json::objectValue &&
+          change.isMember("ChangeType") &&
+          change.isMember("ID") &&
+          change["ChangeType"].type() == Json::stringValue &&
+          (change["ChangeType"].asString() == "NewSeries" ||
+           change["ChangeType"].asString() == "StableSeries") &&
+          change["ID"].type() == Json::stringValue)
+      {
+        uniqueSeries.insert(change["ID"].asString());
+      }
+    }
+
+    std::vector<std::string> series(uniqueSeries.begin(), uniqueSeries.end());
+    Worker worker(series);
+
+    if (threadsCount_ == 1)
+    {
+      worker.Run();
+    }
+    else
+    {
+      boost::thread_group threads;
+      for (unsigned int i = 0; i < threadsCount_; i++)
+      {
+        threads.create_thread(boost::bind(&Worker::Run, &worker));
+      }
+      threads.join_all();
+    }
+
+    filled_ += worker.GetFilledCount();
+    checkpoint_ = std::max(checkpoint_, static_cast<int64_t>(changes["Last"].asInt64()));
+    last_ = std::max(last_, checkpoint_);
+    SetGlobalProperty(GLOBAL_PROPERTY_BACKFILL_CHECKPOINT, boost::lexical_cast<std::string>(checkpoint_));
+    UpdateState();
+
+    if (changes["Done"].asBool())
+    {
+      LOG(INFO) << "The backfill of the OHIF metadata has reached change " << checkpoint_
+                << " (" << filled_ << " series were precomputed)";
+      return OrthancPluginJobStepStatus_Success;
+    }
+    else
+    {
+      return OrthancPluginJobStepStatus_Continue;
+    }
+  }
+
+  virtual void Stop(OrthancPluginJobStopReason /* reason */)
+  {
+  }
+
+  virtual void Reset()
+  {
+    filled_ = 0;
+
+    try
+    {
+      checkpoint_ = boost::lexical_cast<int64_t>(GetGlobalProperty(GLOBAL_PROPERTY_BACKFILL_CHECKPOINT));
+    }
+    catch (boost::bad_lexical_cast&)
+    {
+      checkpoint_ = 0;  // No checkpoint yet, start from the beginning of the log
+    }
+
+    start_ = checkpoint_;
+
+    Json::Value changes;
+    if (OrthancPlugins::RestApiGet(changes, "/changes?last", false) &&
+        changes.type() == Json::objectValue &&
+        changes.isMember("Last") &&
+        changes["Last"].isInt64())
+    {
+      last_ = std::max(checkpoint_, static_cast<int64_t>(changes["Last"].asInt64()));
+    }
+    else
+    {
+      last_ = checkpoint_;
+    }
+
+    UpdateState();
+  }
+};
+#endif
+
+
+static ResourcesCache               cache_;
+static std::string                  userConfiguration_;
+static std::string                  routerBasename_;
+static DataSource                   dataSource_;
+static bool                         preload_;
+static bool                         upgradeMetadata_;
+static unsigned int                 upgradeMetadataRate_;
+static bool                         backfill_;
+static unsigned int                 backfillThreads_;
+static std::string                  preloadQueuePath_;
+static unsigned int                 fetchThreads_;
+static unsigned int                 fetchThreadsPerStudy_;
+static bool                         compressDicomJson_;
+
+void ServeFile(OrthancPluginRestOutput* output,
+               const char* url,
+               const OrthancPluginHttpRequest* request)
+{
+  OrthancPluginContext* context = OrthancPlugins::GetGlobalContext();
+  
+  // The next 3 HTTP headers are required to enable SharedArrayBuffer
+  // (https://web.dev/coop-coep/)
+  OrthancPluginSetHttpHeader(context, output, "Cross-Origin-Embedder-Policy", "require-corp");
+  OrthancPluginSetHttpHeader(context, output, "Cross-Origin-Opener-Policy", "same-origin");
+  OrthancPluginSetHttpHeader(context, output, "Cross-Origin-Resource-Policy", "same-origin");
+
+  std::string uri;
+  if (request->groupsCount > 0)
+  {
+    uri = request->groups[0];
+  }
+
+  if (uri == "app-config.js")
+  {
+    std::string system;
+    Orthanc::EmbeddedResources::GetFileResource(system, Orthanc::EmbeddedResources::APP_CONFIG_SYSTEM);
+
+    std::map<std::string, std::string> dictionary;
+    dictionary["ROUTER_BASENAME"] = routerBasename_;
+    dictionary["USE_DICOM_WEB"] = (dataSource_ == DataSource_DicomWeb ? "true" : "false");
+
+    system = Orthanc::Toolbox::SubstituteVariables(system, dictionary);
+
+    std::string s = (userConfiguration_ + "\n" + system);
+    OrthancPluginAnswerBuffer(context, output, s.c_str(), s.size(), "application/json");
+  }
+  else if (uri == "" ||      // Study list
+           uri == "tmtv" ||  // Total metabolic tumor volume
+           uri == "viewer")  // Default viewer (including MPR)
+  {
+    // Those correspond to the different modes of the OHIF platform:
+    // https://v3-docs.ohif.org/platform/modes/
+    cache_.Answer(context, output, "index.html");
+  }
+  else 
+  {
+    cache_.Answer(context, output, uri);
+  }
+}
+
+
+enum ContentEncoding
+{
+  ContentEncoding_Identity,
+  ContentEncoding_Gzip,
+  ContentEncoding_Deflate
+};
+
+
+// Chooses the encoding of the answer from the "Accept-Encoding" header
+static ContentEncoding NegotiateContentEncoding(const OrthancPluginHttpRequest* request)
+{
+  bool gzip = false;
+  bool deflate = false;
+  
+  for (uint32_t i = 0; i < request->headersCount; i++)
+  {
+    std::string key(request->headersKeys[i]);
+    Orthanc::Toolbox::ToLowerCase(key);
+
+    if (key == "accept-encoding")
+    {
+      std::vector<std::string> codings;
+      Orthanc::Toolbox::TokenizeString(codings, request->headersValues[i], ',');
+
+      for (size_t j = 0; j < codings.size(); j++)
+      {
+        std::vector<std::string> tokens;
+        Orthanc::Toolbox::TokenizeString(tokens, codings[j], ';');
+
+        if (tokens.empty())
+        {
+          continue;
+        }
+
+        std::string coding = Orthanc::Toolbox::StripSpaces(tokens[0]);
+        Orthanc::Toolbox::ToLowerCase(coding);
+
+        // A quality of zero means "not acceptable"
+        bool acceptable = true;
+        for (size_t k = 1; k < tokens.size(); k++)
+        {
+          std::string parameter = Orthanc::Toolbox::StripSpaces(tokens[k]);
+          if (parameter.size() > 2 &&
+              (parameter[0] == 'q' || parameter[0] == 'Q') &&
+              parameter[1] == '=')
+          {
+            acceptable = (atof(parameter.c_str() + 2) > 0);
+          }
+        }
+
+        if (acceptable)
+        {
+          if (coding == "gzip" ||
+              coding == "x-gzip" ||
+              coding == "*")
+          {
+            gzip = true;
+          }
+          else if (coding == "deflate")
+          {
+            deflate = true;
+          }
+        }
+      }
+    }
+  }
+
+  if (gzip)
+  {
+    return ContentEncoding_Gzip;
+  }
+  else if (deflate)
+  {
+    return ContentEncoding_Deflate;
+  }
+  else
+  {
+    return ContentEncoding_Identity;
+  }
+}
+
+
+// The compressed bodies are raw gzip (RFC 1952) or zlib (RFC 1950)
+// streams, as expected by the HTTP clients
+static void CompressHttpBody(std::string& target,
+                             const std::string& source,
+                             ContentEncoding encoding)
+{
+  switch (encoding)
+  {
+    case ContentEncoding_Gzip:
+    {
+      Orthanc::GzipCompressor compressor;
+      compressor.SetPrefixWithUncompressedSize(false);
+      Orthanc::IBufferCompressor::Compress(target, compressor, source);
+      break;
+    }
+
+    case ContentEncoding_Deflate:
+    {
+      Orthanc::ZlibCompressor compressor;
+      compressor.SetPrefixWithUncompressedSize(false);
+      Orthanc::IBufferCompressor::Compress(target, compressor, source);
+      break;
+    }
+
+    default:
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+}
+
+
+static void UncompressGzip(std::string& target,
+                           const std::string& source)
+{
+  Orthanc::GzipCompressor compressor;
+  compressor.SetPrefixWithUncompressedSize(false);
+  Orthanc::IBufferCompressor::Uncompress(target, compressor, source);
+}
+
+
+// Writes the members of a JSON object into the object that is being
+// written by the stream writer
+static void WriteMembers(JsonStreamWriter& writer,
+                         const Json::Value& members)
+{
+  const Json::Value::Members names = members.getMemberNames();
+  for (size_t i = 0; i < names.size(); i++)
+  {
+    writer.Key(names[i]);
+    writer.Value(members[names[i]]);
+  }
+}
+
+
+/**
+ * Mutable version of the DICOM-JSON document of one Orthanc study,
+ * organized by columns. The instances are grouped by
+ * StudyInstanceUID and by SeriesInstanceUID as soon as they are
+ * added, which allows the preload thread to patch the document in
+ * place as instances arrive. Each series stores its instances in a
+ * contiguous vector of fixed-layout records that carry the Orthanc ID
+ * and the pre-serialized metadata of the instance, and the tags of
+ * the studies and of the series are extracted once. Serializing the
+ * document is thus a linear pass that neither looks up tags nor
+ * computes hashes.
+ **/
+class StudyAggregate : public boost::noncopyable
+{
+private:
+  struct InstanceRecord : public SeriesVolume::Slice
+  {
+    std::vector<const std::string*>  members_;  // Members of the "metadata" object of DICOM-JSON
+  };
+
+  typedef std::map<std::string, unsigned int>  Members;  // Interned member => number of instances using it
+
+  /**
+   * The members of the "metadata" objects of the instances are
+   * interned at the series level, as most of them are identical
+   * across the instances of a series (e.g. the UIDs, the modality,
+   * the frame of reference or the size of the images). The interned
+   * members are serialized (as in '"Modality":"CT"'), and are
+   * reference-counted, so that a member is released together with the
+   * last instance that uses it. The order of the instances
+   * and the volume are computed by "Analyze()" once the series has
+   * changed, and are reused by all the serializations.
+   **/
+  struct Series
+  {
+    std::string                  seriesId_;   // Orthanc ID
+    std::string                  patientId_;  // Orthanc ID
+    Json::Value                  tags_;       // Series-level tags, indexed by name
+    std::vector<InstanceRecord>  instances_;
+    Members                      members_;    // Interned members of the instances
+    bool                         analyzed_;   // Whether "order_" and "volume_" are up-to-date
+    std::vector<size_t>          order_;      // Indices in "instances_", in the order of the volume
+    SeriesVolume                 volume_;
+
+    Series() :
+      analyzed_(false)
+    {
+    }
+  };
+
+  typedef std::map<std::string, Series>  SeriesMap;  // SeriesInstanceUID => series
+
+  struct Study
+  {
+    Json::Value  tags_;  // Study-level tags, indexed by name
+    SeriesMap    series_;
+  };
+
+  typedef std::map<std::string, Study>  Studies;  // StudyInstanceUID => study
+
+  struct Location
+  {
+    Studies::iterator    study_;
+    SeriesMap::iterator  series_;
+    size_t               position_;  // Index in the "instances_" vector of the series
+  };
+
+  typedef std::map<std::string, Location>  Index;  // Orthanc instance ID => location
+
+  Studies  studies_;
+  Index    index_;
+  bool     analyzed_;  // Whether all the series are analyzed
+
+  static void AnalyzeSeries(std::vector<size_t>& order,
+                            SeriesVolume& volume,
+                            const std::vector<InstanceRecord>& instances)
+  {
+    std::vector<const SeriesVolume::Slice*> slices(instances.size());
+    for (size_t i = 0; i < instances.size(); i++)
+    {
+      slices[i] = &instances[i];
+    }
+
+    volume.Analyze(order, slices);
+  }
+
+  static void ReleaseMembers(Members& members,
+                             const InstanceRecord& record)
+  {
+    for (size_t i = 0; i < record.members_.size(); i++)
+    {
+      Members::iterator found = members.find(*record.members_[i]);
+      assert(found != members.end() && found->second > 0);
+
+      found->second--;
+      if (found->second == 0)
+      {
+        members.erase(found);
+      }
+    }
+  }
+
+  // "key" is the formatted tag of the UID
+  static bool LookupUid(std::string& target,
+                        const Json::Value& instanceTags,
+                        const std::string& key)
+  {
+    if (instanceTags.isMember(key))
+    {
+      if (instanceTags[key].type() != Json::stringValue)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+      }
+      else
+      {
+        target = instanceTags[key].asString();
+        return true;
+      }
+    }
+    else
+    {
+      return false;
+    }
+  }
+
+  static void CopyTags(Json::Value& target,
+                       const TagsDictionary& tags,
+                       const Json::Value& source)
+  {
+    target = Json::objectValue;
+    
+    for (TagsDictionary::const_iterator tag = tags.begin(); tag != tags.end(); ++tag)
+    {
+      const std::string& key = tag->second.GetKey();
+
+      if (source.isMember(key))
+      {
+        target[tag->second.GetName()] = source[key];
+      }
+    }
+  }
+
+public:
+  StudyAggregate() :
+    analyzed_(true)
+  {
+  }
+
+  size_t GetInstancesCount() const
+  {
+    return index_.size();
+  }
+
+  void Swap(StudyAggregate& other)
+  {
+    // The iterators of the index remain valid, as the nodes of the
+    // maps are not moved by "std::map::swap()"
+    studies_.swap(other.studies_);
+    index_.swap(other.index_);
+    std::swap(analyzed_, other.analyzed_);
+  }
+
+  void AddInstance(const std::string& instanceId,
+                   const Json::Value& instanceTags)
+  {
+    static const std::string STUDY_INSTANCE_UID = Orthanc::DICOM_TAG_STUDY_INSTANCE_UID.Format();
+    static const std::string SERIES_INSTANCE_UID = Orthanc::DICOM_TAG_SERIES_INSTANCE_UID.Format();
+
+    std::string studyInstanceUid, seriesInstanceUid;
+    if (LookupUid(studyInstanceUid, instanceTags, STUDY_INSTANCE_UID) &&
+        LookupUid(seriesInstanceUid, instanceTags, SERIES_INSTANCE_UID))
+    {
+      RemoveInstance(instanceId);  // In the case of a modification of the instance
+
+      Studies::iterator study = studies_.find(studyInstanceUid);
+      if (study == studies_.end())
+      {
+        study = studies_.insert(std::make_pair(studyInstanceUid, Study())).first;
+        CopyTags(study->second.tags_, ohifStudyTags_, instanceTags);
+      }
+
+      SeriesMap::iterator series = study->second.series_.find(seriesInstanceUid);
+      if (series == study->second.series_.end())
+      {
+        series = study->second.series_.insert(std::make_pair(seriesInstanceUid, Series())).first;
+        CopyTags(series->second.tags_, ohifSeriesTags_, instanceTags);
+
+        // The parents are hashed once per series
+        std::string patientId, sopInstanceUid;
+        LookupUid(patientId, instanceTags, Orthanc::DICOM_TAG_PATIENT_ID.Format());
+        LookupUid(sopInstanceUid, instanceTags, Orthanc::DICOM_TAG_SOP_INSTANCE_UID.Format());
+
+        Orthanc::DicomInstanceHasher hasher(patientId, studyInstanceUid, seriesInstanceUid, sopInstanceUid);
+        series->second.seriesId_ = hasher.HashSeries();
+        series->second.patientId_ = hasher.HashPatient();
+      }
+
+      std::vector<InstanceRecord>& instances = series->second.instances_;
+      instances.push_back(InstanceRecord());
+
+      InstanceRecord& record = instances.back();
+      record.instanceId_ = instanceId;
+
+      std::string member;
+      for (TagsDictionary::const_iterator tag = ohifInstanceTags_.begin(); tag != ohifInstanceTags_.end(); ++tag)
+      {
+        const std::string& key = tag->second.GetKey();
+        if (instanceTags.isMember(key))
+        {
+          JsonStreamWriter::FormatMember(member, tag->second.GetName(), instanceTags[key]);
+
+          Members::iterator counted = series->second.members_.insert(std::make_pair(member, 0u)).first;
+          counted->second++;
+
+          const std::string* interned = &counted->first;
+          record.members_.push_back(interned);
+
+          if (tag->first == Orthanc::DICOM_TAG_IMAGE_ORIENTATION_PATIENT)
+          {
+            record.orientation_ = interned;
+          }
+          else if (tag->first == Orthanc::DICOM_TAG_ROWS)
+          {
+            record.rows_ = interned;
+          }
+          else if (tag->first == Orthanc::DICOM_TAG_COLUMNS)
+          {
+            record.columns_ = interned;
+          }
+        }
+      }
+
+      record.ReadGeometry(instanceTags);
+
+      series->second.analyzed_ = false;
+      analyzed_ = false;
+
+      Location location;
+      location.study_ = study;
+      location.series_ = series;
+      location.position_ = instances.size() - 1;
+      index_[instanceId] = location;
+    }
+  }
+
+  bool RemoveInstance(const std::string& instanceId)
+  {
+    Index::iterator found = index_.find(instanceId);
+    if (found == index_.end())
+    {
+      return false;
+    }
+
+    const Location location = found->second;
+    index_.erase(found);
+
+    // Swap with the last record of the series, so that the vector
+    // remains contiguous
+    std::vector<InstanceRecord>& instances = location.series_->second.instances_;
+    assert(location.position_ < instances.size());
+
+    ReleaseMembers(location.series_->second.members_, instances[location.position_]);
+
+    if (location.position_ + 1 != instances.size())
+    {
+      std::swap(instances[location.position_], instances.back());
+
+      Index::iterator moved = index_.find(instances[location.position_].instanceId_);
+      assert(moved != index_.end());
+      moved->second.position_ = location.position_;
+    }
+
+    instances.pop_back();
+
+    location.series_->second.analyzed_ = false;
+    analyzed_ = false;
+
+    if (instances.empty())
+    {
+      location.study_->second.series_.erase(location.series_);
+
+      if (location.study_->second.series_.empty())
+      {
+        studies_.erase(location.study_);
+      }
+    }
+
+    return true;
+  }
+
+  bool IsAnalyzed() const
+  {
+    return analyzed_;
+  }
+
+  // Sorts the instances of the series that have changed since the
+  // previous call, and computes their volume
+  void Analyze()
+  {
+    if (!analyzed_)
+    {
+      for (Studies::iterator it = studies_.begin(); it != studies_.end(); ++it)
+      {
+        for (SeriesMap::iterator it2 = it->second.series_.begin(); it2 != it->second.series_.end(); ++it2)
+        {
+          Series& series = it2->second;
+          if (!series.analyzed_)
+          {
+            AnalyzeSeries(series.order_, series.volume_, series.instances_);
+            series.analyzed_ = true;
+          }
+        }
+      }
+
+      analyzed_ = true;
+    }
+  }
+
+  bool HasInstance(const std::string& instanceId) const
+  {
+    return index_.find(instanceId) != index_.end();
+  }
+
+  // Tells whether the given Orthanc patient or series is a parent of
+  // the instances of this aggregate
+  bool HasParent(Orthanc::ResourceType level,
+                 const std::string& parentId) const
+  {
+    for (Studies::const_iterator it = studies_.begin(); it != studies_.end(); ++it)
+    {
+      for (SeriesMap::const_iterator it2 = it->second.series_.begin(); it2 != it->second.series_.end(); ++it2)
+      {
+        switch (level)
+        {
+          case Orthanc::ResourceType_Patient:
+            if (it2->second.patientId_ == parentId)
+            {
+              return true;
+            }
+            break;
+
+          case Orthanc::ResourceType_Series:
+            if (it2->second.seriesId_ == parentId)
+            {
+              return true;
+            }
+            break;
+
+          default:
+            throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+        }
+      }
+    }
+
+    return false;
+  }
+
+  // The document is written study by study, series by series, and
+  // instance by instance, without building its "Json::Value" tree
+  void Serialize(std::string& target) const
+  {
+    // https://v3-docs.ohif.org/configuration/dataSources/dicom-json
+    target.clear();
+
+    JsonStreamWriter writer(target);
+    writer.StartObject();
+    writer.Key("studies");
+    writer.StartArray();
+  
+    for (Studies::const_iterator it = studies_.begin(); it != studies_.end(); ++it)
+    {
+      writer.StartObject();
+      WriteMembers(writer, it->second.tags_);
+
+      writer.Key("series");
+      writer.StartArray();
+
+      for (SeriesMap::const_iterator it2 = it->second.series_.begin(); it2 != it->second.series_.end(); ++it2)
+      {
+        assert(!it2->second.instances_.empty());
+
+        writer.StartObject();
+        WriteMembers(writer, it2->second.tags_);
+
+        const std::vector<InstanceRecord>& instances = it2->second.instances_;
+
+        // Fallback if "Analyze()" was not called since the last change
+        std::vector<size_t> localOrder;
+        SeriesVolume localVolume;
+        if (!it2->second.analyzed_)
+        {
+          AnalyzeSeries(localOrder, localVolume, instances);
+        }
+
+        const std::vector<size_t>& order = (it2->second.analyzed_ ? it2->second.order_ : localOrder);
+        const SeriesVolume& volume = (it2->second.analyzed_ ? it2->second.volume_ : localVolume);
+
+        // Extension of the DICOM-JSON format, ignored by OHIF
+        writer.Key("Volume");
+        writer.StartObject();
+        if (volume.IsGeometric() &&
+            instances.size() >= 2)
+        {
+          writer.Key("SliceSpacing");
+          writer.Value(volume.GetSliceSpacing());
+          writer.Key("IsUniform");
+          writer.Value(volume.IsUniform());
+        }
+        writer.Key("IsReconstructable");
+        writer.Value(volume.IsReconstructable());
+        writer.EndObject();
+
+        writer.Key("instances");
+        writer.StartArray();
+
+        for (size_t i = 0; i < order.size(); i++)
+        {
+          const InstanceRecord& instance = instances[order[i]];
+
+          writer.StartObject();
+          writer.Key("metadata");
+          writer.StartObject();
+
+          for (size_t j = 0; j < instance.members_.size(); j++)
+          {
+            writer.RawMember(*instance.members_[j]);
+          }
+
+          writer.EndObject();
+          writer.Key("url");
+          writer.String("dicomweb:../instances/" + instance.instanceId_ + "/file");
+          writer.EndObject();
+        }
+
+        writer.EndArray();
+        writer.EndObject();
+      }
+
+      writer.EndArray();
+      writer.EndObject();
+    }
+
+    writer.EndArray();
+    writer.EndObject();
+
+    assert(writer.IsComplete());
+  }
+};
+
+
+/**
+ * Cache of the most recently used study aggregates. It is only
+ * enabled if the preload thread is running, as the latter is
+ * responsible for patching the aggregates as new instances arrive.
+ **/
+class StudyAggregatesCache : public boost::noncopyable
+{
+private:
+  class Aggregate : public boost::noncopyable
+  {
+  private:
+    boost::shared_mutex  mutex_;
+    StudyAggregate       content_;
+    uint64_t             revision_;
+    std::string          gzip_;  // Compressed document, empty if not computed yet
+    std::string          fingerprint_;          // Fingerprint of the listing of the study that was last validated...
+    uint64_t             fingerprintRevision_;  // ... at this revision of the aggregate
+
+    // The series are sorted lazily, as several instances are usually
+    // patched in a row by the preload thread
+    void Analyze()
+    {
+      {
+        boost::shared_lock<boost::shared_mutex> lock(mutex_);
+        if (content_.IsAnalyzed())
+        {
+          return;
+        }
+      }
+
+      boost::unique_lock<boost::shared_mutex> lock(mutex_);
+      content_.Analyze();
+    }
+
+  public:
+    Aggregate(StudyAggregate& content,
+              const std::string& fingerprint) :
+      revision_(0),
+      fingerprint_(fingerprint),
+      fingerprintRevision_(0)
+    {
+      content_.Swap(content);
+      content_.Analyze();
+    }
+
+    void AddInstance(const std::string& instanceId,
+                     const Json::Value& instanceTags)
+    {
+      boost::unique_lock<boost::shared_mutex> lock(mutex_);
+      content_.AddInstance(instanceId, instanceTags);
+      revision_++;
+      gzip_.clear();
+    }
+
+    void RemoveInstance(const std::string& instanceId)
+    {
+      boost::unique_lock<boost::shared_mutex> lock(mutex_);
+      content_.RemoveInstance(instanceId);
+      revision_++;
+      gzip_.clear();
+    }
+
+    // The compressed document is kept until the aggregate is patched
+    void SerializeGzip(std::string& target)
+    {
+      std::string uncompressed;
+      uint64_t revision;
+
+      Analyze();
+
+      {
+        boost::shared_lock<boost::shared_mutex> lock(mutex_);
+        if (!gzip_.empty())
+        {
+          target = gzip_;
+          return;
+        }
+
+        content_.Serialize(uncompressed);
+        revision = revision_;
+      }
+
+      CompressHttpBody(target, uncompressed, ContentEncoding_Gzip);
+
+      boost::unique_lock<boost::shared_mutex> lock(mutex_);
+      if (revision == revision_)
+      {
+        gzip_ = target;
+      }
+    }
+
+    bool HasInstance(const std::string& instanceId)
+    {
+      boost::shared_lock<boost::shared_mutex> lock(mutex_);
+      return content_.HasInstance(instanceId);
+    }
+
+    bool HasParent(Orthanc::ResourceType level,
+                   const std::string& parentId)
+    {
+      boost::shared_lock<boost::shared_mutex> lock(mutex_);
+      return content_.HasParent(level, parentId);
+    }
+
+    void Serialize(std::string& target)
+    {
+      Analyze();
+
+      boost::shared_lock<boost::shared_mutex> lock(mutex_);
+      content_.Serialize(target);
+    }
+
+    /**
+     * Tells whether the aggregate matches the given listing of the
+     * study. This is the case if it was validated against the same
+     * fingerprint, and was not patched since. Otherwise, the listing
+     * has changed: This change is only explained by the patches if
+     * the aggregate was patched since its validation, and if it now
+     * contains exactly the listed instances, in which case the
+     * fingerprint of the listing is adopted.
+     **/
+    bool Validate(const std::string& fingerprint,
+                  const std::list<std::string>& instancesIds)
+    {
+      {
+        boost::shared_lock<boost::shared_mutex> lock(mutex_);
+
+        if (revision_ == fingerprintRevision_)
+        {
+          return (fingerprint_ == fingerprint);
+        }
+        
+        if (content_.GetInstancesCount() != instancesIds.size())
+        {
+          return false;
+        }
+
+        for (std::list<std::string>::const_iterator it = instancesIds.begin(); it != instancesIds.end(); ++it)
+        {
+          if (!content_.HasInstance(*it))
+          {
+            return false;
+          }
+        }
+      }
+
+      boost::unique_lock<boost::shared_mutex> lock(mutex_);
+      fingerprint_ = fingerprint;
+      fingerprintRevision_ = revision_;
+      return true;
+    }
+  };
+
+  typedef boost::shared_ptr<Aggregate>                 AggregatePointer;
+  typedef std::map<std::string, AggregatePointer>      Content;  // Orthanc study ID => aggregate
+  typedef Orthanc::LeastRecentlyUsedIndex<std::string>  Index;
+
+  // Orthanc study ID => (number of running builds, whether the study was modified during the builds)
+  typedef std::map<std::string, std::pair<unsigned int, bool> >  Builds;
+
+  boost::mutex  mutex_;
+  size_t        maxSize_;
+  Content       content_;
+  Index         index_;
+  Builds        builds_;
+  uint64_t      deletions_;
+
+  void CheckSize()
+  {
+    while (index_.GetSize() > maxSize_)
+    {
+      content_.erase(index_.RemoveOldest());
+    }
+  }
+
+  // The mutex must be locked
+  void Remove(const std::list<std::string>& studiesIds)
+  {
+    for (std::list<std::string>::const_iterator it = studiesIds.begin(); it != studiesIds.end(); ++it)
+    {
+      content_.erase(*it);
+      index_.Invalidate(*it);
+    }
+  }
+
+  uint64_t BeginBuild(const std::string& studyId)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Builds::iterator found = builds_.find(studyId);
+    if (found == builds_.end())
+    {
+      builds_[studyId] = std::make_pair(1u, false);
+    }
+    else
+    {
+      found->second.first++;
+    }
+
+    return deletions_;
+  }
+
+  void EndBuild(const std::string& studyId,
+                const std::string& fingerprint,
+                uint64_t deletions,
+                StudyAggregate* aggregate /* can be NULL */)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Builds::iterator found = builds_.find(studyId);
+    assert(found != builds_.end() &&
+           found->second.first > 0);
+
+    const bool modified = (found->second.second ||
+                           deletions != deletions_);
+
+    found->second.first--;
+    if (found->second.first == 0)
+    {
+      builds_.erase(found);
+    }
+
+    // Only store the aggregate if no instance was added to or
+    // removed from the study while it was being built
+    if (aggregate != NULL &&
+        !modified &&
+        maxSize_ > 0)
+    {
+      content_[studyId] = AggregatePointer(new Aggregate(*aggregate, fingerprint));
+      index_.AddOrMakeMostRecent(studyId);
+      CheckSize();
+    }
+  }
+
+public:
+  class Builder : public boost::noncopyable
+  {
+  private:
+    StudyAggregatesCache&  cache_;
+    std::string            studyId_;
+    std::string            fingerprint_;
+    uint64_t               deletions_;
+    bool                   done_;
+    StudyAggregate         aggregate_;
+
+  public:
+    // "fingerprint" is the fingerprint of the listing of the study
+    // from which the aggregate is built
+    Builder(StudyAggregatesCache& cache,
+            const std::string& studyId,
+            const std::string& fingerprint) :
+      cache_(cache),
+      studyId_(studyId),
+      fingerprint_(fingerprint),
+      deletions_(cache.BeginBuild(studyId)),
+      done_(false)
+    {
+    }
+
+    ~Builder()
+    {
+      if (!done_)
+      {
+        cache_.EndBuild(studyId_, fingerprint_, deletions_, NULL);
+      }
+    }
+
+    StudyAggregate& GetAggregate()
+    {
+      return aggregate_;
+    }
+
+    // Hand the aggregate over to the cache
+    void Commit()
+    {
+      if (done_)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+      }
+
+      done_ = true;
+      cache_.EndBuild(studyId_, fingerprint_, deletions_, &aggregate_);
+    }
+
+    // Serialize the aggregate, then hand it over to the cache
+    void Commit(std::string& target)
+    {
+      if (done_)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+      }
+
+      aggregate_.Analyze();
+      aggregate_.Serialize(target);
+      Commit();
+    }
+  };
+
+  StudyAggregatesCache() :
+    maxSize_(0),
+    deletions_(0)
+  {
+  }
+
+  void SetMaximumSize(size_t maxSize)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    maxSize_ = maxSize;
+    CheckSize();
+  }
+
+  // If "gzip" is "true", the document is compressed as gzip. The
+  // aggregate is ignored if it doesn't match the given fingerprint
+  // and instances of the current listing of the study, i.e. if it
+  // lags behind the content of the study.
+  bool Serialize(std::string& target,
+                 const std::string& studyId,
+                 bool gzip,
+                 const std::string& fingerprint,
+                 const std::list<std::string>& instancesIds)
+  {
+    AggregatePointer aggregate;
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      Content::const_iterator found = content_.find(studyId);
+      if (found == content_.end())
+      {
+        return false;
+      }
+
+      aggregate = found->second;
+      index_.MakeMostRecent(studyId);
+    }
+
+    assert(aggregate.get() != NULL);
+
+    if (!aggregate->Validate(fingerprint, instancesIds))
+    {
+      return false;
+    }
+
+    if (gzip)
+    {
+      aggregate->SerializeGzip(target);
+    }
+    else
+    {
+      aggregate->Serialize(target);
+    }
+    
+    return true;
+  }
+
+  void NotifyNewInstance(const std::string& studyId,
+                         const std::string& instanceId,
+                         const Json::Value& instanceTags)
+  {
+    AggregatePointer aggregate;
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      Builds::iterator found = builds_.find(studyId);
+      if (found != builds_.end())
+      {
+        found->second.second = true;
+      }
+
+      Content::const_iterator cached = content_.find(studyId);
+      if (cached == content_.end())
+      {
+        return;
+      }
+      else
+      {
+        aggregate = cached->second;
+      }
+    }
+
+    assert(aggregate.get() != NULL);
+    aggregate->AddInstance(instanceId, instanceTags);
+  }
+
+  void NotifyDeletedInstance(const std::string& instanceId)
+  {
+    // The parent study of a deleted instance is unknown, so all the
+    // cached aggregates are patched
+    std::list<AggregatePointer> aggregates;
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      deletions_++;
+
+      for (Content::const_iterator it = content_.begin(); it != content_.end(); ++it)
+      {
+        aggregates.push_back(it->second);
+      }
+    }
+
+    for (std::list<AggregatePointer>::iterator it = aggregates.begin(); it != aggregates.end(); ++it)
+    {
+      (*it)->RemoveInstance(instanceId);
+    }
+  }
+
+  // Evicts the aggregates that contain the given instance, whose
+  // DICOM file was replaced
+  void InvalidateInstance(const std::string& instanceId)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    deletions_++;
+
+    std::list<std::string> studiesIds;
+    for (Content::const_iterator it = content_.begin(); it != content_.end(); ++it)
+    {
+      if (it->second->HasInstance(instanceId))
+      {
+        studiesIds.push_back(it->first);
+      }
+    }
+
+    Remove(studiesIds);
+  }
+
+  // Evicts the aggregates that belong to the given patient or series
+  void InvalidateParent(Orthanc::ResourceType level,
+                        const std::string& parentId)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    deletions_++;
+
+    std::list<std::string> studiesIds;
+    for (Content::const_iterator it = content_.begin(); it != content_.end(); ++it)
+    {
+      if (it->second->HasParent(level, parentId))
+      {
+        studiesIds.push_back(it->first);
+      }
+    }
+
+    Remove(studiesIds);
+  }
+
+  void Invalidate(const std::string& studyId)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    deletions_++;
+
+    if (content_.erase(studyId) > 0)
+    {
+      index_.Invalidate(studyId);
+    }
+  }
+
+  void Clear()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    deletions_++;
+
+    content_.clear();
+
+    while (!index_.IsEmpty())
+    {
+      index_.RemoveOldest();
+    }
+  }
+};
+
+
+static void GetParentIds(std::string& studyId,
+                         std::string& seriesId,
+                         const Json::Value& instanceTags)
+{
+  Orthanc::DicomInstanceHasher hasher(instanceTags[Orthanc::DICOM_TAG_PATIENT_ID.Format()].asString(),
+                                      instanceTags[Orthanc::DICOM_TAG_STUDY_INSTANCE_UID.Format()].asString(),
+                                      instanceTags[Orthanc::DICOM_TAG_SERIES_INSTANCE_UID.Format()].asString(),
+                                      instanceTags[Orthanc::DICOM_TAG_SOP_INSTANCE_UID.Format()].asString());
+  studyId = hasher.HashStudy();
+  seriesId = hasher.HashSeries();
+}
+
+
+/**
+ * Loads the OHIF metadata of the given instances of one series. The
+ * loading is split in phases, so that the REST calls of all the
+ * series of a study can be distributed over the fetch pool:
+ *
+ * 1. "Prepare()" reads the record of the series and the write-behind
+ *    buffer of the preload workers, and encodes the series using a
+ *    single call to the REST API if most of it is missing.
+ * 2. "Encode()" encodes one of the other missing instances, or one of
+ *    the instances to be refreshed.
+ * 3. "Store()" merges the encoded instances back into the record of
+ *    the series, and prunes the instances that were deleted.
+ * 4. "AddTo()" adds the instances to the aggregate of the study.
+ *
+ * The identifiers of the instances point into the listing of the
+ * series, which outlives the loader, so that they are not copied.
+ **/
+class SeriesLoader : public boost::noncopyable
+{
+private:
+  typedef std::vector<const std::string*>  Identifiers;
+
+  std::string                    seriesId_;
+  const std::list<std::string>&  instancesIds_;
+  const std::set<std::string>&   refresh_;
+  std::set<std::string>          outdated_;  // Instances whose DICOM file was replaced
+  Json::Value                    records_;   // Orthanc instance ID => OHIF tags
+  std::set<std::string>          stale_;
+  Json::Value                    bulk_;     // Instances encoded by "Prepare()"
+  Identifiers                    missing_;
+  std::vector<Json::Value>       encoded_;  // Instances encoded by "Encode()", null if not found
+
+  static bool IsLessIdentifier(const std::string* a,
+                               const std::string* b)
+  {
+    return *a < *b;
+  }
+
+  // Whether the record of the instance must be ignored
+  bool IsRefreshed(const std::string& instanceId) const
+  {
+    return (refresh_.find(instanceId) != refresh_.end() ||
+            outdated_.find(instanceId) != outdated_.end());
+  }
+
+public:
+  SeriesLoader(const std::string& seriesId,
+               const std::list<std::string>& instancesIds,
+               const std::set<std::string>& refresh) :
+    seriesId_(seriesId),
+    instancesIds_(instancesIds),
+    refresh_(refresh),
+    bulk_(Json::objectValue)
+  {
+  }
+
+  void Prepare()
+  {
+    if (!ReadSeriesRecord(records_, seriesId_))
+    {
+      records_ = Json::objectValue;
+    }
+
+    pendingSeries_.Lookup(records_, seriesId_);
+    outdatedInstances_.Lookup(outdated_, instancesIds_);
+
+    Identifiers alive;
+    Identifiers missing;
+
+    alive.reserve(instancesIds_.size());
+  
+    for (std::list<std::string>::const_iterator it = instancesIds_.begin(); it != instancesIds_.end(); ++it)
+    {
+      alive.push_back(&*it);
+
+      if (!records_.isMember(*it) ||
+          IsRefreshed(*it))
+      {
+        missing.push_back(&*it);
+      }
+    }
+
+    std::sort(alive.begin(), alive.end(), IsLessIdentifier);
+
+    // The parent series of a deleted instance is unknown when the
+    // deletion is signaled, so the record is pruned lazily
+    const Json::Value::Members members = records_.getMemberNames();
+    for (size_t i = 0; i < members.size(); i++)
+    {
+      if (!std::binary_search(alive.begin(), alive.end(), &members[i], IsLessIdentifier))
+      {
+        stale_.insert(members[i]);
+      }
+    }
+
+    if (missing.size() > 1 &&
+        missing.size() * 2 >= instancesIds_.size())
+    {
+      // Most of the series is missing, which is cheaper to encode
+      // using a single call to the REST API
+      Json::Value all;
+      if (EncodeOhifSeries(all, seriesId_))
+      {
+        for (size_t i = 0; i < missing.size(); i++)
+        {
+          if (all.isMember(*missing[i]))
+          {
+            bulk_[*missing[i]].swap(all[*missing[i]]);
+          }
+        }
+      }
+    }
+    else
+    {
+      missing_.swap(missing);
+      encoded_.resize(missing_.size());
+    }
+  }
+
+  size_t GetMissingCount() const
+  {
+    return missing_.size();
+  }
+
+  // Can be called concurrently for distinct indices
+  void Encode(size_t index)
+  {
+    const std::string& instanceId = *missing_[index];
+    
+    if (outdated_.find(instanceId) != outdated_.end())
+    {
+      // Metadata created by earlier versions of the plugin
+      DeleteMetadata(instanceId, GetCacheUri(instanceId));
+    }
+
+    // The legacy metadata of the instances to be refreshed is outdated
+    Json::Value t;
+    if (IsRefreshed(instanceId) ?
+        EncodeOhifInstance(t, instanceId) :
+        GetOhifInstance(t, instanceId))
+    {
+      encoded_[index].swap(t);
+    }
+  }
+
+  void Store()
+  {
+    Json::Value encoded = bulk_;
+
+    for (size_t i = 0; i < missing_.size(); i++)
+    {
+      if (!encoded_[i].isNull())
+      {
+        encoded[*missing_[i]] = encoded_[i];
+      }
+    }
+
+    if (!encoded.empty() ||
+        !stale_.empty())
+    {
+      MergeIntoSeriesRecord(seriesId_, encoded, stale_);
+    }
+
+    for (std::set<std::string>::const_iterator it = outdated_.begin(); it != outdated_.end(); ++it)
+    {
+      outdatedInstances_.Remove(*it);
+    }
+  }
+
+  void AddTo(StudyAggregate& target)
+  {
+    // The identifiers are compared by address, as they all point into
+    // the listing of the series
+    typedef std::map<const std::string*, size_t>  Positions;
+
+    Positions encoded;
+    for (size_t i = 0; i < missing_.size(); i++)
+    {
+      encoded[missing_[i]] = i;
+    }
+    
+    for (std::list<std::string>::const_iterator it = instancesIds_.begin(); it != instancesIds_.end(); ++it)
+    {
+      Positions::const_iterator found = encoded.find(&*it);
+
+      if (found != encoded.end())
+      {
+        if (!encoded_[found->second].isNull())
+        {
+          target.AddInstance(*it, encoded_[found->second]);
+        }
+      }
+      else if (bulk_.isMember(*it))
+      {
+        target.AddInstance(*it, bulk_[*it]);
+      }
+      else if (records_.isMember(*it) &&
+               !IsRefreshed(*it))
+      {
+        target.AddInstance(*it, records_[*it]);
+      }
+    }
+  }
+};
+
+
+enum SeriesLoaderPhase
+{
+  SeriesLoaderPhase_Prepare,
+  SeriesLoaderPhase_Encode,
+  SeriesLoaderPhase_Store
+};
+
+
+// One phase of the loading of a study, to be run by the fetch pool
+class SeriesLoaderBatch : public FetchPool::IBatch
+{
+private:
+  typedef std::pair<SeriesLoader*, size_t>  Task;  // (series, index of the missing instance)
+
+  SeriesLoaderPhase  phase_;
+  std::vector<Task>  tasks_;
+
+public:
+  SeriesLoaderBatch(SeriesLoaderPhase phase,
+                    const std::vector<SeriesLoader*>& loaders) :
+    phase_(phase)
+  {
+    for (size_t i = 0; i < loaders.size(); i++)
+    {
+      if (phase == SeriesLoaderPhase_Encode)
+      {
+        for (size_t j = 0; j < loaders[i]->GetMissingCount(); j++)
+        {
+          tasks_.push_back(std::make_pair(loaders[i], j));
+        }
+      }
+      else
+      {
+        tasks_.push_back(std::make_pair(loaders[i], 0));
+      }
+    }
+  }
+
+  virtual size_t GetSize() const
+  {
+    return tasks_.size();
+  }
+
+  virtual void Execute(size_t index)
+  {
+    if (pendingInstances_.IsStopped())
+    {
+      // Orthanc is stopping, don't delay its shutdown
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_CanceledJob);
+    }
+
+    SeriesLoader& loader = *tasks_[index].first;
+
+    switch (phase_)
+    {
+      case SeriesLoaderPhase_Prepare:
+        loader.Prepare();
+        break;
+
+      case SeriesLoaderPhase_Encode:
+        loader.Encode(tasks_[index].second);
+        break;
+
+      case SeriesLoaderPhase_Store:
+        loader.Store();
+        break;
+
+      default:
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+    }
+  }
+};
+
+
+/**
+ * Instances of one study, grouped by series. They are listed using a
+ * single call to the REST API that only expands the series, as
+ * opposed to "/studies/{id}/instances" that expands each instance.
+ * The fingerprint identifies the content of the study: It changes as
+ * soon as an instance is added or removed, or as soon as a new DICOM
+ * file is stored in one of the series (which updates the
+ * "LastUpdate" field of the series, e.g. if an instance is
+ * overwritten). As "LastUpdate" has a resolution of one second, it
+ * cannot tell apart two writes in the same second: While one of the
+ * series was updated less than "LAST_UPDATE_MARGIN" seconds ago, the
+ * listing is not settled, and its fingerprint includes a revision
+ * that is unique to the listing. The instances of one single series
+ * can also be loaded, in order to serve the series-level DICOM-JSON
+ * documents.
+ **/
+class StudyInstances : public boost::noncopyable
+{
+public:
+  typedef std::map<std::string, std::list<std::string> >  Series;  // Orthanc series ID => Orthanc instance IDs
+
+private:
+  Series                              series_;
+  std::map<std::string, Json::Value>  mainDicomTags_;  // Orthanc series ID => main DICOM tags
+  std::list<std::string>              all_;
+  std::string                         fingerprint_;
+  bool                                settled_;
+
+  void Clear()
+  {
+    series_.clear();
+    mainDicomTags_.clear();
+    all_.clear();
+    fingerprint_.clear();
+    settled_ = true;
+  }
+
+  // The series that were updated after this time are not settled
+  static std::string GetSettledTime()
+  {
+    const boost::posix_time::ptime now = boost::posix_time::second_clock::universal_time();
+    return boost::posix_time::to_iso_string(now - boost::posix_time::seconds(LAST_UPDATE_MARGIN));
+  }
+
+  // "settledTime" is the result of "GetSettledTime()", in the same
+  // format as the "LastUpdate" field, which is in UTC
+  void AddSeries(std::set<std::string>& content,
+                 const Json::Value& series,
+                 const std::string& settledTime)
+  {
+    static const char* const KEY_ID = "ID";
+    static const char* const KEY_INSTANCES = "Instances";
+    static const char* const KEY_LAST_UPDATE = "LastUpdate";
+    static const char* const KEY_MAIN_DICOM_TAGS = "MainDicomTags";
+
+    if (series.type() != Json::objectValue ||
+        !series.isMember(KEY_ID) ||
+        !series.isMember(KEY_INSTANCES) ||
+        series[KEY_ID].type() != Json::stringValue ||
+        series[KEY_INSTANCES].type() != Json::arrayValue)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+    }
+
+    const std::string seriesId = series[KEY_ID].asString();
+    const Json::Value& instances = series[KEY_INSTANCES];
+
+    if (series.isMember(KEY_LAST_UPDATE) &&
+        series[KEY_LAST_UPDATE].type() == Json::stringValue)
+    {
+      const std::string lastUpdate = series[KEY_LAST_UPDATE].asString();
+      content.insert(seriesId + ":" + lastUpdate);
+
+      if (lastUpdate >= settledTime)
+      {
+        settled_ = false;
+      }
+    }
+
+    if (series.isMember(KEY_MAIN_DICOM_TAGS) &&
+        series[KEY_MAIN_DICOM_TAGS].type() == Json::objectValue)
+    {
+      mainDicomTags_[seriesId] = series[KEY_MAIN_DICOM_TAGS];
+    }
+
+    std::list<std::string>& target = series_[seriesId];
+
+    for (Json::ArrayIndex i = 0; i < instances.size(); i++)
+    {
+      if (instances[i].type() != Json::stringValue)
+      {
+        throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+      }
+
+      target.push_back(instances[i].asString());
+      all_.push_back(instances[i].asString());
+      content.insert(instances[i].asString());
+    }
+  }
+
+  void ComputeFingerprint(const std::set<std::string>& content)
+  {
+    std::string s;
+    for (std::set<std::string>::const_iterator it = content.begin(); it != content.end(); ++it)
+    {
+      s += *it + "\n";
+    }
+
+    if (!settled_)
+    {
+      s += "Revision:" + Orthanc::Toolbox::GenerateUuid() + "\n";
+    }
+
+    Orthanc::Toolbox::ComputeSHA1(fingerprint_, s);
+  }
+
+public:
+  StudyInstances() :
+    settled_(true)
+  {
+  }
+
+  void Load(const std::string& studyId)
+  {
+    Json::Value series;
+    if (!OrthancPlugins::RestApiGet(series, "/studies/" + studyId + "/series", false))
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_UnknownResource);
+    }
+
+    if (series.type() != Json::arrayValue)
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+    }
+
+    Clear();
+
+    const std::string settledTime = GetSettledTime();
+    std::set<std::string> content;
+  
+    for (Json::ArrayIndex i = 0; i < series.size(); i++)
+    {
+      AddSeries(content, series[i], settledTime);
+    }
+
+    ComputeFingerprint(content);
+  }
+
+  void LoadSeries(const std::string& seriesId)
+  {
+    Json::Value series;
+    if (!OrthancPlugins::RestApiGet(series, "/series/" + seriesId, false))
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_UnknownResource);
+    }
+
+    Clear();
+
+    std::set<std::string> content;
+    AddSeries(content, series, GetSettledTime());
+    ComputeFingerprint(content);
+  }
+
+  const Series& GetSeries() const
+  {
+    return series_;
+  }
+
+  // Returns the main DICOM tags of one series, as indexed by their
+  // DICOM keyword in the answers of the REST API
+  const Json::Value& GetMainDicomTags(const std::string& seriesId) const
+  {
+    static const Json::Value empty = Json::objectValue;
+
+    std::map<std::string, Json::Value>::const_iterator found = mainDicomTags_.find(seriesId);
+    if (found == mainDicomTags_.end())
+    {
+      return empty;
+    }
+    else
+    {
+      return found->second;
+    }
+  }
+
+  const std::list<std::string>& GetAll() const
+  {
+    return all_;
+  }
+
+  const std::string& GetFingerprint() const
+  {
+    return fingerprint_;
+  }
+
+  // Whether the fingerprint identifies the content of the study in a
+  // stable way, i.e. if no series was updated recently
+  bool IsSettled() const
+  {
+    return settled_;
+  }
+};
+
+
+// The instances in "refresh" are re-encoded even if already cached
+static void GenerateOhifStudy(StudyAggregate& target,
+                              const StudyInstances& instances,
+                              const std::set<std::string>& refresh)
+{
+  typedef StudyInstances::Series  Series;
+
+  const Series& series = instances.GetSeries();
+
+  // The instances of this study that are still waiting in the preload
+  // queue (e.g. because they were modified) jump ahead of the bulk
+  // work, so that the aggregate of the study converges quickly
+  pendingInstances_.Promote(instances.GetAll());
+
+  std::vector<boost::shared_ptr<SeriesLoader> > loaders;
+  std::vector<SeriesLoader*> pointers;
+
+  loaders.reserve(series.size());
+  pointers.reserve(series.size());
+  
+  for (Series::const_iterator it = series.begin(); it != series.end(); ++it)
+  {
+    loaders.push_back(boost::shared_ptr<SeriesLoader>(new SeriesLoader(it->first, it->second, refresh)));
+    pointers.push_back(loaders.back().get());
+  }
+
+  {
+    SeriesLoaderBatch batch(SeriesLoaderPhase_Prepare, pointers);
+    fetchPool_.Run(batch);
+  }
+
+  {
+    SeriesLoaderBatch batch(SeriesLoaderPhase_Encode, pointers);
+    fetchPool_.Run(batch);
+  }
+
+  {
+    SeriesLoaderBatch batch(SeriesLoaderPhase_Store, pointers);
+    fetchPool_.Run(batch);
+  }
+
+  // The aggregate is filled by one single thread, in the order of the
+  // listing of the study
+  for (size_t i = 0; i < pointers.size(); i++)
+  {
+    pointers[i]->AddTo(target);
+  }
+}
+
+
+static void GenerateOhifStudy(StudyAggregate& target,
+                              const StudyInstances& instances)
+{
+  GenerateOhifStudy(target, instances, std::set<std::string>());
+}
+
+
+/**
+ * The DICOM-JSON document of a study that has become stable is
+ * precompiled by the preload workers, and persisted as the "4202"
+ * metadata of the study, together with the fingerprint of the
+ * instances it was generated from. The document is stored as gzip,
+ * which is the encoding that is sent to the HTTP clients.
+ **/
+static const char* const KEY_FINGERPRINT = "Fingerprint";
+static const char* const KEY_GZIP = "Gzip";
+
+
+static std::string GetStudyCacheUri(const std::string& studyId)
+{
+  return "/studies/" + studyId + "/metadata/" + METADATA_OHIF;
+}
+
+
+static void StoreStudyDocument(const std::string& studyId,
+                               const std::string& fingerprint,
+                               const std::string& document)
+{
+  std::string compressed;
+  CompressHttpBody(compressed, document, ContentEncoding_Gzip);
+
+  std::string encoded;
+  Orthanc::Toolbox::EncodeBase64(encoded, compressed);
+
+  Json::Value record = Json::objectValue;
+  record[KEY_VERSION] = static_cast<int>(METADATA_VERSION);
+  record[KEY_FINGERPRINT] = fingerprint;
+  record[KEY_GZIP] = encoded;
+
+  std::string metadata;
+  Orthanc::Toolbox::WriteFastJson(metadata, record);
+
+  PutMetadata(studyId, GetStudyCacheUri(studyId), metadata);
+}
+
+
+// Returns the gzip-compressed document, if it was generated from the
+// current content of the study. Outdated documents are removed.
+static bool ReadStudyDocument(std::string& compressed,
+                              const std::string& studyId,
+                              const std::string& fingerprint)
+{
+  const std::string uri = GetStudyCacheUri(studyId);
+
+  std::string metadata;
+  if (!OrthancPlugins::RestApiGetString(metadata, uri, false))
+  {
+    return false;
+  }
+
+  Json::Value record;
+  if (Orthanc::Toolbox::ReadJson(record, metadata) &&
+      record.type() == Json::objectValue &&
+      record.isMember(KEY_VERSION) &&
+      record.isMember(KEY_FINGERPRINT) &&
+      record.isMember(KEY_GZIP) &&
+      record[KEY_VERSION].type() == Json::intValue &&
+      record[KEY_VERSION].asInt() == METADATA_VERSION &&
+      record[KEY_FINGERPRINT].type() == Json::stringValue &&
+      record[KEY_FINGERPRINT].asString() == fingerprint &&
+      record[KEY_GZIP].type() == Json::stringValue)
+  {
+    try
+    {
+      Orthanc::Toolbox::DecodeBase64(compressed, record[KEY_GZIP].asString());
+      return true;
+    }
+    catch (Orthanc::OrthancException&)
+    {
+    }
+  }
+
+  DeleteMetadata(studyId, uri);
+  return false;
+}
+
+
+// Lists the instances of one study, in order to replace the instances
+// of this study that are waiting in the preload queue by a single
+// study-level item, which is then encoded by series
+static void CoalesceStudy(const std::string& studyId)
+{
+  StudyInstances instances;
+  instances.Load(studyId);
+
+  if (pendingInstances_.Coalesce(studyId, instances.GetAll(), COALESCE_MINIMUM))
+  {
+    LOG(INFO) << "Coalesced the queued instances of study " << studyId << " in the OHIF preload queue";
+  }
+}
+
+
+/**
+ * The OHIF names of the study-level and series-level tags are the
+ * DICOM keywords that index the main DICOM tags in the answers of the
+ * REST API of Orthanc. The tags that are not main DICOM tags are only
+ * available in the documents of the series.
+ **/
+static void ParseMainDicomTags(Json::Value& target,
+                               const TagsDictionary& tags,
+                               const Json::Value& mainDicomTags)
+{
+  if (mainDicomTags.type() != Json::objectValue)
+  {
+    return;
+  }
+
+  for (TagsDictionary::const_iterator it = tags.begin(); it != tags.end(); ++it)
+  {
+    const std::string& name = it->second.GetName();
+
+    if (mainDicomTags.isMember(name))
+    {
+      Json::Value source = Json::objectValue;
+      source[it->second.GetKey()] = mainDicomTags[name];
+      ParseTagFromOrthanc(target, it->second.GetKey(), name, it->second.GetType(), source);
+    }
+  }
+}
+
+
+static std::string GetSeriesDocumentUrl(const std::string& seriesId)
+{
+  // Relative to the OHIF viewer, just like the URLs of the instances
+  return "../series/" + seriesId + "/ohif-dicom-json";
+}
+
+
+/**
+ * The "skeleton" of a study is a DICOM-JSON document that only
+ * contains the study-level and the series-level tags, together with
+ * the URL of the DICOM-JSON document of each series. It is built from
+ * the main DICOM tags that are stored in the database of Orthanc, so
+ * it doesn't need the OHIF metadata of any instance.
+ **/
+static void GenerateOhifSkeleton(std::string& target,
+                                 const std::string& studyId,
+                                 const StudyInstances& instances)
+{
+  static const char* const KEY_MAIN_DICOM_TAGS = "MainDicomTags";
+  static const char* const KEY_PATIENT_MAIN_DICOM_TAGS = "PatientMainDicomTags";
+
+  Json::Value study;
+  if (!OrthancPlugins::RestApiGet(study, "/studies/" + studyId, false) ||
+      study.type() != Json::objectValue)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_UnknownResource);
+  }
+
+  Json::Value studyTags = Json::objectValue;
+  ParseMainDicomTags(studyTags, ohifStudyTags_, study[KEY_PATIENT_MAIN_DICOM_TAGS]);
+  ParseMainDicomTags(studyTags, ohifStudyTags_, study[KEY_MAIN_DICOM_TAGS]);
+
+  target.clear();
+
+  JsonStreamWriter writer(target);
+  writer.StartObject();
+  writer.Key("studies");
+  writer.StartArray();
+  writer.StartObject();
+  WriteMembers(writer, studyTags);
+
+  writer.Key("series");
+  writer.StartArray();
+
+  const StudyInstances::Series& series = instances.GetSeries();
+  for (StudyInstances::Series::const_iterator it = series.begin(); it != series.end(); ++it)
+  {
+    if (!it->second.empty())
+    {
+      Json::Value seriesTags = Json::objectValue;
+      ParseMainDicomTags(seriesTags, ohifSeriesTags_, instances.GetMainDicomTags(it->first));
+
+      writer.StartObject();
+      WriteMembers(writer, seriesTags);
+      writer.Key("url");
+      writer.String(GetSeriesDocumentUrl(it->first));
+      writer.EndObject();
+    }
+  }
+
+  writer.EndArray();
+  writer.EndObject();
+  writer.EndArray();
+  writer.EndObject();
+
+  assert(writer.IsComplete());
+}
+
+
+/**
+ * Fingerprints of the settled listings of the most recently requested
+ * studies. A fingerprint remains valid as long as Orthanc has not
+ * signaled any write of a DICOM file (new, modified or deleted
+ * resource) since the listing started, which allows to validate the
+ * copy of a document that is cached by a client without listing its
+ * study again. As the changes of the instances do not tell their
+ * parent study, any write invalidates all the fingerprints. The
+ * writes of other Orthanc servers that share the same database are
+ * not signaled, so this cache must be disabled in such setups.
+ **/
+class StudyFingerprints : public boost::noncopyable
+{
+private:
+  typedef std::pair<std::string, uint64_t>              Fingerprint;  // (fingerprint, writes before the listing)
+  typedef std::map<std::string, Fingerprint>            Content;      // Orthanc study ID => fingerprint
+  typedef Orthanc::LeastRecentlyUsedIndex<std::string>  Index;
+
+  boost::mutex  mutex_;
+  size_t        maxSize_;
+  Content       content_;
+  Index         index_;
+  uint64_t      writes_;
+
+public:
+  explicit StudyFingerprints(size_t maxSize) :
+    maxSize_(maxSize),
+    writes_(0)
+  {
+  }
+
+  void SetMaximumSize(size_t maxSize)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    maxSize_ = maxSize;
+
+    while (index_.GetSize() > maxSize_)
+    {
+      content_.erase(index_.RemoveOldest());
+    }
+  }
+
+  void NotifyWrite()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    writes_++;
+  }
+
+  // Must be called before listing the study
+  uint64_t GetWrites()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return writes_;
+  }
+
+  // "writes" is the value of "GetWrites()" before the listing
+  void Store(const std::string& studyId,
+             const std::string& fingerprint,
+             uint64_t writes)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (writes == writes_ &&
+        maxSize_ > 0)
+    {
+      content_[studyId] = std::make_pair(fingerprint, writes);
+      index_.AddOrMakeMostRecent(studyId);
+
+      while (index_.GetSize() > maxSize_)
+      {
+        content_.erase(index_.RemoveOldest());
+      }
+    }
+  }
+
+  bool Lookup(std::string& fingerprint,
+              const std::string& studyId)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Content::iterator found = content_.find(studyId);
+    if (found == content_.end())
+    {
+      return false;
+    }
+    else if (found->second.second != writes_)
+    {
+      content_.erase(found);
+      index_.Invalidate(studyId);
+      return false;
+    }
+    else
+    {
+      fingerprint = found->second.first;
+      index_.MakeMostRecent(studyId);
+      return true;
+    }
+  }
+};
+
+
+static StudyAggregatesCache  aggregates_;
+static StudyFingerprints     fingerprints_(STUDY_FINGERPRINTS);
+static unsigned int          maxStudyAggregates_;
+static PreloadThrottle       preloadThrottle_;
+static SingleFlight          studyFlights_;
+
+// Separate budgets for the requests that are answered from the caches,
+// and for the requests that generate a document from the records
+static AdmissionControl      cachedRequests_("cached OHIF studies");
+static AdmissionControl      generations_("generations of OHIF studies");
+
+
+/**
+ * Pool of threads that precompute the OHIF metadata of the instances
+ * that are waiting in the "pendingInstances_" queue. The instances
+ * are dequeued by batches, and their metadata is grouped by series in
+ * the "pendingSeries_" buffer, which is flushed to the records of the
+ * series by the same threads.
+ **/
+class PreloadWorkers : public boost::noncopyable
+{
+public:
+  struct Statistics
+  {
+    uint64_t  processed_;
+    uint64_t  failures_;
+    uint64_t  busyTime_;  // In milliseconds
+  };
+
+private:
+  class Worker : public boost::noncopyable
+  {
+  private:
+    unsigned int   index_;
+    boost::mutex   mutex_;
+    Statistics     statistics_;
+    boost::thread  thread_;
+
+    // "studyId" is set to the parent study of the instance, if any
+    bool Process(std::string& studyId,
+                 const std::string& instanceId)
+    {
+      try
+      {
+        // The metadata is not written by this method, as it is
+        // flushed to the record of the series by "FlushPendingSeries()"
+        const boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+
+        const bool outdated = outdatedInstances_.Contains(instanceId);
+        if (outdated)
+        {
+          // Metadata created by earlier versions of the plugin
+          DeleteMetadata(instanceId, GetCacheUri(instanceId));
+        }
+
+        Json::Value instanceTags;
+        const bool found = EncodeOhifInstance(instanceTags, instanceId);
+
+        preloadThrottle_.AddRestLatency((boost::posix_time::microsec_clock::universal_time() - start).total_milliseconds());
+        
+        if (found)
+        {
+          std::string seriesId;
+          GetParentIds(studyId, seriesId, instanceTags);
+
+          pendingSeries_.Add(seriesId, instanceId, instanceTags);
+          aggregates_.NotifyNewInstance(studyId, instanceId, instanceTags);
+        }
+
+        if (outdated)
+        {
+          // The pending metadata now hides the record of the series
+          outdatedInstances_.Remove(instanceId);
+        }
+
+        return true;
+      }
+      catch (Orthanc::OrthancException& e)
+      {
+        LOG(ERROR) << "Cannot preload the OHIF metadata of instance " << instanceId << ": " << e.What();
+        return false;
+      }
+    }
+
+    // Rethrows "ErrorCode_CanceledJob" if Orthanc stops during the
+    // processing, in which case the study must be put back
+    bool ProcessStudy(const PreloadQueue::Item& study)
+    {
+      const std::string& studyId = study.GetId();
+      
+      try
+      {
+        StudyInstances instances;
+        instances.Load(studyId);
+
+        StudyAggregatesCache::Builder builder(aggregates_, studyId, instances.GetFingerprint());
+        GenerateOhifStudy(builder.GetAggregate(), instances, study.GetInstances());
+
+        if (study.IsPrecompile() &&
+            instances.IsSettled())
+        {
+          // The study is stable: Its document is persisted, so that
+          // the first opening in the viewer is immediate. This is
+          // pointless if its fingerprint is unique to this listing.
+          std::string document;
+          builder.Commit(document);
+          StoreStudyDocument(studyId, instances.GetFingerprint(), document);
+        }
+        else
+        {
+          builder.Commit();
+        }
+        
+        return true;
+      }
+      catch (Orthanc::OrthancException& e)
+      {
+        if (e.GetErrorCode() == Orthanc::ErrorCode_CanceledJob)
+        {
+          throw;
+        }
+
+        LOG(ERROR) << "Cannot preload the OHIF metadata of study " << studyId << ": " << e.What();
+        return false;
+      }
+    }
+
+    // Orthanc is stopping: The items that are not processed are put
+    // back into the queue, in order to be saved into the spill log
+    static void Requeue(const std::vector<PreloadQueue::Item>& batch,
+                        size_t start)
+    {
+      for (size_t i = start; i < batch.size(); i++)
+      {
+        pendingInstances_.Requeue(batch[i]);
+      }
+    }
+
+    void ProcessBatch(const std::vector<PreloadQueue::Item>& batch)
+    {
+      const boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+
+      size_t processed = 0;
+      unsigned int failures = 0;
+      std::map<std::string, size_t> studies;  // Parent studies of the processed instances
+          
+      for (size_t i = 0; i < batch.size(); i++)
+      {
+        if (pendingInstances_.IsStopped())
+        {
+          Requeue(batch, i);
+          break;
+        }
+        
+        bool success = true;
+        bool canceled = false;
+
+        switch (batch[i].GetLevel())
+        {
+          case Orthanc::ResourceType_Study:
+            try
+            {
+              success = ProcessStudy(batch[i]);
+            }
+            catch (Orthanc::OrthancException&)
+            {
+              canceled = true;
+              break;
+            }
+
+            if (!success &&
+                !batch[i].GetInstances().empty())
+            {
+              // The instances that were coalesced into the study are
+              // processed one by one, so that only the faulty ones
+              // are dropped
+              pendingInstances_.Uncoalesce(batch[i]);
+            }
+            break;
+
+          case Orthanc::ResourceType_Series:
+            FlushPendingSeries(batch[i].GetId());
+            break;
+
+          default:
+          {
+            std::string studyId;
+            success = Process(studyId, batch[i].GetId());
+
+            if (!studyId.empty())
+            {
+              studies[studyId]++;
+            }
+            break;
+          }
+        }
+
+        if (canceled)
+        {
+          // The study was interrupted: It is put back as well, with
+          // the instances that were coalesced into it
+          Requeue(batch, i);
+          break;
+        }
+
+        processed++;
+        
+        if (!success)
+        {
+          failures++;
+        }
+      }
+
+      if (pendingInstances_.GetSize() > batch.size())
+      {
+        // There is a backlog: The remaining instances of the studies
+        // that dominate this batch are encoded in bulk
+        for (std::map<std::string, size_t>::const_iterator it = studies.begin(); it != studies.end(); ++it)
+        {
+          if (it->second >= COALESCE_MINIMUM)
+          {
+            try
+            {
+              CoalesceStudy(it->first);
+            }
+            catch (Orthanc::OrthancException& e)
+            {
+              LOG(ERROR) << "Cannot coalesce the instances of study " << it->first << ": " << e.What();
+            }
+          }
+        }
+      }
+
+      // The results are in "pendingSeries_" or stored, or the items
+      // were put back: They can be acknowledged, so that their
+      // segments of the spill log are released at a checkpoint
+      pendingInstances_.Acknowledge(batch);
+
+      const boost::posix_time::time_duration elapsed = boost::posix_time::microsec_clock::universal_time() - start;
+
+      boost::mutex::scoped_lock lock(mutex_);
+      statistics_.processed_ += processed;
+      statistics_.busyTime_ += elapsed.total_milliseconds();
+      statistics_.failures_ += failures;
+    }
+
+    static void Run(Worker* that)
+    {
+      std::vector<PreloadQueue::Item> batch;
+
+      // There is no polling: The thread sleeps until an item is
+      // queued, until the oldest pending series must be flushed, or
+      // until Orthanc stops
+      while (preloadThrottle_.WaitActive(that->index_))
+      {
+        if (pendingInstances_.DequeueBatch(batch, preloadThrottle_.GetBatchSize(), pendingSeries_.GetFlushTimeout()))
+        {
+          that->ProcessBatch(batch);
+        }
+        else if (pendingInstances_.IsStopped())
+        {
+          break;
+        }
+
+        FlushPendingSeries(false);
+        pendingInstances_.Checkpoint(pendingSeries_);
+      }
+    }
+
+  public:
+    explicit Worker(unsigned int index) :
+      index_(index)
+    {
+      statistics_.processed_ = 0;
+      statistics_.failures_ = 0;
+      statistics_.busyTime_ = 0;
+      thread_ = boost::thread(Run, this);
+    }
+
+    ~Worker()
+    {
+      Join();
+    }
+
+    void Join()
+    {
+      if (thread_.joinable())
+      {
+        thread_.join();
+      }
+    }
+
+    void GetStatistics(Statistics& target)
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+      target = statistics_;
+    }
+  };
+
+  boost::mutex          mutex_;
+  std::vector<Worker*>  workers_;
+
+public:
+  ~PreloadWorkers()
+  {
+    Stop();
+  }
+
+  bool IsRunning()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    return !workers_.empty();
+  }
+
+  void Start(unsigned int count)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (!workers_.empty())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+    }
+
+    for (unsigned int i = 0; i < std::max(1u, count); i++)
+    {
+      workers_.push_back(new Worker(i));
+    }
+  }
+
+  // Wakes up the threads, cancels their pending work, then joins
+  // them. The unprocessed items stay in "pendingInstances_".
+  void Stop()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    pendingInstances_.Stop();
+    preloadThrottle_.Stop();
+
+    for (size_t i = 0; i < workers_.size(); i++)
+    {
+      assert(workers_[i] != NULL);
+      workers_[i]->Join();
+
+      Statistics statistics;
+      workers_[i]->GetStatistics(statistics);
+      delete workers_[i];
+
+      LOG(INFO) << "OHIF preload worker " << i << " has processed " << statistics.processed_
+                << " instances (" << statistics.failures_ << " failures, busy during "
+                << statistics.busyTime_ << "ms)";
+    }
+
+    workers_.clear();
+  }
+
+  void GetStatistics(std::vector<Statistics>& target)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    target.resize(workers_.size());
+    for (size_t i = 0; i < workers_.size(); i++)
+    {
+      assert(workers_[i] != NULL);
+      workers_[i]->GetStatistics(target[i]);
+    }
+  }
+};
+
+
+static PreloadWorkers  preloadWorkers_;
+static unsigned int    preloadThreads_;
+
+
+static void PublishMetrics()
+{
+#if HAS_ORTHANC_PLUGIN_METRICS == 1
+  OrthancPluginContext* context = OrthancPlugins::GetGlobalContext();
+
+  OrthancPluginSetMetricsValue(context, "ohif_preload_queue_size",
+                               static_cast<float>(pendingInstances_.GetSize()), OrthancPluginMetricsType_Default);
+  OrthancPluginSetMetricsValue(context, "ohif_preload_queue_priority",
+                               static_cast<float>(pendingInstances_.GetSize(PreloadPriority_High)), OrthancPluginMetricsType_Default);
+  OrthancPluginSetMetricsValue(context, "ohif_preload_queue_spilled",
+                               static_cast<float>(pendingInstances_.GetSpilledCount()), OrthancPluginMetricsType_Default);
+
+  OrthancPluginSetMetricsValue(context, "ohif_preload_active_threads",
+                               static_cast<float>(preloadThrottle_.GetThreadsCount()), OrthancPluginMetricsType_Default);
+  OrthancPluginSetMetricsValue(context, "ohif_preload_batch_size",
+                               static_cast<float>(preloadThrottle_.GetBatchSize()), OrthancPluginMetricsType_Default);
+
+  {
+    std::vector<PreloadWorkers::Statistics> workers;
+    preloadWorkers_.GetStatistics(workers);
+
+    for (size_t i = 0; i < workers.size(); i++)
+    {
+      const std::string prefix = "ohif_preload_worker_" + boost::lexical_cast<std::string>(i);
+      OrthancPluginSetMetricsValue(context, (prefix + "_processed").c_str(),
+                                   static_cast<float>(workers[i].processed_), OrthancPluginMetricsType_Default);
+      OrthancPluginSetMetricsValue(context, (prefix + "_failures").c_str(),
+                                   static_cast<float>(workers[i].failures_), OrthancPluginMetricsType_Default);
+      OrthancPluginSetMetricsValue(context, (prefix + "_busy_ms").c_str(),
+                                   static_cast<float>(workers[i].busyTime_), OrthancPluginMetricsType_Default);
+    }
+  }
+
+  OrthancPluginSetMetricsValue(context, "ohif_shared_study_requests",
+                               static_cast<float>(studyFlights_.GetSharedCount()), OrthancPluginMetricsType_Default);
+
+  {
+    AdmissionControl::Statistics cached, generations;
+    cachedRequests_.GetStatistics(cached);
+    generations_.GetStatistics(generations);
+
+    OrthancPluginSetMetricsValue(context, "ohif_cached_requests_active",
+                                 static_cast<float>(cached.active_), OrthancPluginMetricsType_Default);
+    OrthancPluginSetMetricsValue(context, "ohif_cached_requests_queued",
+                                 static_cast<float>(cached.queued_), OrthancPluginMetricsType_Default);
+    OrthancPluginSetMetricsValue(context, "ohif_cached_requests_refused",
+                                 static_cast<float>(cached.refused_), OrthancPluginMetricsType_Default);
+    OrthancPluginSetMetricsValue(context, "ohif_generations_active",
+                                 static_cast<float>(generations.active_), OrthancPluginMetricsType_Default);
+    OrthancPluginSetMetricsValue(context, "ohif_generations_queued",
+                                 static_cast<float>(generations.queued_), OrthancPluginMetricsType_Default);
+    OrthancPluginSetMetricsValue(context, "ohif_generations_refused",
+                                 static_cast<float>(generations.refused_), OrthancPluginMetricsType_Default);
+  }
+
+  {
+    SeriesRecordsCache::Statistics statistics;
+    seriesRecords_.GetStatistics(statistics);
+
+    OrthancPluginSetMetricsValue(context, "ohif_series_cache_hits",
+                                 static_cast<float>(statistics.hits_), OrthancPluginMetricsType_Default);
+    OrthancPluginSetMetricsValue(context, "ohif_series_cache_misses",
+                                 static_cast<float>(statistics.misses_), OrthancPluginMetricsType_Default);
+    OrthancPluginSetMetricsValue(context, "ohif_series_cache_count",
+                                 static_cast<float>(statistics.count_), OrthancPluginMetricsType_Default);
+    OrthancPluginSetMetricsValue(context, "ohif_series_cache_size_mb",
+                                 static_cast<float>(statistics.memoryUsage_) / (1024.0f * 1024.0f),
+                                 OrthancPluginMetricsType_Default);
+  }
+#endif
+}
+
+
+// The body is always sent with the negotiated encoding, even if it
+// is small, as its entity tag depends on this encoding
+static void AnswerUncompressedDicomJson(OrthancPluginRestOutput* output,
+                                        const std::string& body,
+                                        ContentEncoding encoding)
+{
+  OrthancPluginContext* context = OrthancPlugins::GetGlobalContext();
+
+  if (encoding != ContentEncoding_Identity)
+  {
+    std::string compressed;
+    CompressHttpBody(compressed, body, encoding);
+
+    OrthancPluginSetHttpHeader(context, output, "Content-Encoding",
+                               encoding == ContentEncoding_Gzip ? "gzip" : "deflate");
+    OrthancPluginAnswerBuffer(context, output, compressed.c_str(), compressed.size(), "application/json");
+  }
+  else
+  {
+    OrthancPluginAnswerBuffer(context, output, body.c_str(), body.size(), "application/json");
+  }
+}
+
+
+// The body is already compressed as gzip if "isGzip" is "true"
+static void AnswerDicomJson(OrthancPluginRestOutput* output,
+                            const std::string& body,
+                            bool isGzip,
+                            ContentEncoding encoding)
+{
+  OrthancPluginContext* context = OrthancPlugins::GetGlobalContext();
+
+  if (compressDicomJson_)
+  {
+    OrthancPluginSetHttpHeader(context, output, "Vary", "Accept-Encoding");
+  }
+
+  if (isGzip &&
+      encoding == ContentEncoding_Gzip)
+  {
+    OrthancPluginSetHttpHeader(context, output, "Content-Encoding", "gzip");
+    OrthancPluginAnswerBuffer(context, output, body.c_str(), body.size(), "application/json");
+  }
+  else if (isGzip)
+  {
+    std::string uncompressed;
+    UncompressGzip(uncompressed, body);
+    AnswerUncompressedDicomJson(output, uncompressed, encoding);
+  }
+  else
+  {
+    AnswerUncompressedDicomJson(output, body, encoding);
+  }
+}
+
+
+// Tells whether the request was refused by the admission control
+static bool IsRefused(const Orthanc::OrthancException& e)
+{
+  return e.GetHttpStatus() == Orthanc::HttpStatus_503_ServiceUnavailable;
+}
+
+
+static void AnswerRefused(OrthancPluginRestOutput* output,
+                          const Orthanc::OrthancException& e)
+{
+  OrthancPluginContext* context = OrthancPlugins::GetGlobalContext();
+
+  const std::string message = (e.HasDetails() ? e.GetDetails() : e.What());
+  LOG(WARNING) << "OHIF plugin is overloaded: " << message;
+
+  const std::string retryAfter = boost::lexical_cast<std::string>(RETRY_AFTER);
+  OrthancPluginSetHttpHeader(context, output, "Retry-After", retryAfter.c_str());
+  OrthancPluginSendHttpStatus(context, output, 503, message.c_str(), message.size());
+}
+
+
+static bool HasGetArgument(const OrthancPluginHttpRequest* request,
+                           const std::string& key)
+{
+  for (uint32_t i = 0; i < request->getCount; i++)
+  {
+    if (key == request->getKeys[i])
+    {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+/**
+ * Computes the DICOM-JSON document of one study, which is shared by
+ * the concurrent requests for the same content of this study (e.g.
+ * if the study is opened by many clients at once). The document is
+ * compressed as gzip if the plugin compresses its answers, so that
+ * the compression is also shared by the requests.
+ **/
+class StudyDocumentComputation : public SingleFlight::IComputation
+{
+private:
+  const std::string&     studyId_;
+  const StudyInstances&  instances_;
+
+public:
+  StudyDocumentComputation(const std::string& studyId,
+                           const StudyInstances& instances) :
+    studyId_(studyId),
+    instances_(instances)
+  {
+  }
+
+  static bool IsGzip()
+  {
+    return compressDicomJson_;
+  }
+
+  virtual void Compute(std::string& value)
+  {
+    std::string body;
+    bool found;
+
+    {
+      AdmissionControl::Ticket ticket(cachedRequests_);
+      found = ReadStudyDocument(body, studyId_, instances_.GetFingerprint());
+    }
+
+    if (found)
+    {
+      if (IsGzip())
+      {
+        value.swap(body);
+      }
+      else
+      {
+        UncompressGzip(value, body);
+      }
+    }
+    else
+    {
+      AdmissionControl::Ticket ticket(generations_);
+
+      StudyAggregatesCache::Builder builder(aggregates_, studyId_, instances_.GetFingerprint());
+      GenerateOhifStudy(builder.GetAggregate(), instances_);
+      builder.Commit(body);
+
+      if (IsGzip())
+      {
+        CompressHttpBody(value, body, ContentEncoding_Gzip);
+      }
+      else
+      {
+        value.swap(body);
+      }
+    }
+  }
+};
+
+
+/**
+ * Strong entity tag of a DICOM-JSON document. It is derived from the
+ * fingerprint of the instances of the study or series, from the
+ * version of the OHIF metadata, and from the representation of the
+ * document (skeleton or not, and content encoding), which can thus be
+ * validated without assembling the document. This requires the
+ * answer to be sent with exactly the given encoding, whatever its
+ * size, which is ensured by "AnswerDicomJson()".
+ **/
+static std::string GetEntityTag(const std::string& fingerprint,
+                                bool skeleton,
+                                ContentEncoding encoding)
+{
+  std::string tag = "\"" + fingerprint + "-" + boost::lexical_cast<std::string>(METADATA_VERSION);
+
+  if (skeleton)
+  {
+    tag += "-skeleton";
+  }
+
+  switch (encoding)
+  {
+    case ContentEncoding_Identity:
+      break;
+
+    case ContentEncoding_Gzip:
+      tag += "-gzip";
+      break;
+
+    case ContentEncoding_Deflate:
+      tag += "-deflate";
+      break;
+
+    default:
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+
+  return tag + "\"";
+}
+
+
+// Tells whether the "If-None-Match" header of the request matches the
+// entity tag of the current document
+static bool IsNotModified(const OrthancPluginHttpRequest* request,
+                          const std::string& entityTag)
+{
+  for (uint32_t i = 0; i < request->headersCount; i++)
+  {
+    std::string key(request->headersKeys[i]);
+    Orthanc::Toolbox::ToLowerCase(key);
+
+    if (key == "if-none-match")
+    {
+      std::vector<std::string> tags;
+      Orthanc::Toolbox::TokenizeString(tags, request->headersValues[i], ',');
+
+      for (size_t j = 0; j < tags.size(); j++)
+      {
+        std::string tag = Orthanc::Toolbox::StripSpaces(tags[j]);
+
+        // "If-None-Match" uses the weak comparison of entity tags
+        if (tag.size() > 2 &&
+            tag[0] == 'W' &&
+            tag[1] == '/')
+        {
+          tag = tag.substr(2);
+        }
+
+        if (tag == "*" ||
+            tag == entityTag)
+        {
+          return true;
+        }
+      }
+    }
+  }
+
+  return false;
+}
+
+
+// Sets the headers that let the clients cache the document, provided
+// that they revalidate it using its entity tag
+static void SetCacheHeaders(OrthancPluginRestOutput* output,
+                            const std::string& entityTag)
+{
+  OrthancPluginContext* context = OrthancPlugins::GetGlobalContext();
+  OrthancPluginSetHttpHeader(context, output, "ETag", entityTag.c_str());
+  OrthancPluginSetHttpHeader(context, output, "Cache-Control", "no-cache");
+}
+
+
+static void AnswerNotModified(OrthancPluginRestOutput* output,
+                              const std::string& entityTag)
+{
+  OrthancPluginContext* context = OrthancPlugins::GetGlobalContext();
+
+  if (compressDicomJson_)
+  {
+    OrthancPluginSetHttpHeader(context, output, "Vary", "Accept-Encoding");
+  }
+
+  SetCacheHeaders(output, entityTag);
+  OrthancPluginSendHttpStatusCode(context, output, 304);
 }
 
 
 void GetOhifStudy(OrthancPluginRestOutput* output,
                   const char* url,
                   const OrthancPluginHttpRequest* request)
+{
+  const std::string studyId = request->groups[0];
+
+  const ContentEncoding encoding = (compressDicomJson_ ?
+                                    NegotiateContentEncoding(request) :
+                                    ContentEncoding_Identity);
+  const bool acceptsGzip = (encoding == ContentEncoding_Gzip);
+
+  const boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+
+  const bool skeleton = HasGetArgument(request, "skeleton");
+
+  std::string body;
+  boost::shared_ptr<const std::string> shared;
+  bool isGzip = false;
+  std::string entityTag;
+
+  try
+  {
+    StudyInstances instances;
+    bool done;
+
+    {
+      AdmissionControl::Ticket ticket(cachedRequests_);
+
+      // If the study was not written since its last listing, its
+      // fingerprint is enough to validate the copy of the document
+      // that is cached by the client, without listing the study
+      std::string fingerprint;
+      if (fingerprints_.Lookup(fingerprint, studyId))
+      {
+        entityTag = GetEntityTag(fingerprint, skeleton, encoding);
+
+        if (IsNotModified(request, entityTag))
+        {
+          AnswerNotModified(output, entityTag);
+          return;
+        }
+      }
+
+      const uint64_t writes = fingerprints_.GetWrites();
+      instances.Load(studyId);
+
+      if (instances.IsSettled())
+      {
+        fingerprints_.Store(studyId, instances.GetFingerprint(), writes);
+      }
+
+      entityTag = GetEntityTag(instances.GetFingerprint(), skeleton, encoding);
+
+      if (IsNotModified(request, entityTag))
+      {
+        AnswerNotModified(output, entityTag);
+        return;
+      }
+
+      if (skeleton)
+      {
+        GenerateOhifSkeleton(body, studyId, instances);
+        done = true;
+      }
+      else if (aggregates_.Serialize(body, studyId, acceptsGzip, instances.GetFingerprint(), instances.GetAll()))
+      {
+        isGzip = acceptsGzip;
+        done = true;
+      }
+      else
+      {
+        done = false;
+      }
+    }
+
+    if (!done)
+    {
+      // The concurrent requests for the same content of the study
+      // share one single computation of the document (single-flight)
+      StudyDocumentComputation computation(studyId, instances);
+      shared = studyFlights_.Run(studyId + ":" + instances.GetFingerprint(), computation);
+      isGzip = StudyDocumentComputation::IsGzip();
+    }
+  }
+  catch (Orthanc::OrthancException& e)
+  {
+    if (IsRefused(e))
+    {
+      AnswerRefused(output, e);
+      return;
+    }
+    else
+    {
+      throw;
+    }
+  }
+
+  // The preload threads back off if the viewer is slowed down
+  preloadThrottle_.AddViewerLatency((boost::posix_time::microsec_clock::universal_time() - start).total_milliseconds());
+
+  SetCacheHeaders(output, entityTag);
+  AnswerDicomJson(output, (shared.get() == NULL ? body : *shared), isGzip, encoding);
+
+  PublishMetrics();
+}
+
+
+// The DICOM-JSON document of one series, whose URL is found in the
+// skeleton of its parent study
+void GetOhifSeries(OrthancPluginRestOutput* output,
+                   const char* /* url */,
+                   const OrthancPluginHttpRequest* request)
+{
+  const std::string seriesId = request->groups[0];
+
+  const ContentEncoding encoding = (compressDicomJson_ ?
+                                    NegotiateContentEncoding(request) :
+                                    ContentEncoding_Identity);
+
+  const boost::posix_time::ptime start = boost::posix_time::microsec_clock::universal_time();
+
+  std::string body;
+  std::string entityTag;
+
+  try
+  {
+    StudyInstances instances;
+    instances.LoadSeries(seriesId);
+
+    entityTag = GetEntityTag(instances.GetFingerprint(), false, encoding);
+
+    if (IsNotModified(request, entityTag))
+    {
+      AnswerNotModified(output, entityTag);
+      return;
+    }
+
+    AdmissionControl::Ticket ticket(generations_);
+
+    StudyAggregate aggregate;
+    GenerateOhifStudy(aggregate, instances);
+    aggregate.Analyze();
+    aggregate.Serialize(body);
+  }
+  catch (Orthanc::OrthancException& e)
+  {
+    if (IsRefused(e))
+    {
+      AnswerRefused(output, e);
+      return;
+    }
+    else
+    {
+      throw;
+    }
+  }
+
+  preloadThrottle_.AddViewerLatency((boost::posix_time::microsec_clock::universal_time() - start).total_milliseconds());
+
+  SetCacheHeaders(output, entityTag);
+  AnswerDicomJson(output, body, false, encoding);
+
+  PublishMetrics();
+}
+
+
+void PreloadOhifStudy(OrthancPluginRestOutput* output,
+                      const char* /* url */,
+                      const OrthancPluginHttpRequest* request)
 {
   OrthancPluginContext* context = OrthancPlugins::GetGlobalContext();
 
-  const std::string studyId = request->groups[0];
+  if (request->method != OrthancPluginHttpMethod_Post)
+  {
+    OrthancPluginSendMethodNotAllowed(context, output, "POST");
+    return;
+  }
 
-  Json::Value v;
-  GenerateOhifStudy(v, studyId);
+  // The study jumps ahead of the bulk work of the preload threads, so
+  // that it is ready once the viewer requests it
+  if (preloadWorkers_.IsRunning())
+  {
+    pendingInstances_.EnqueueStudy(request->groups[0]);
+  }
 
-  std::string s;
-  Orthanc::Toolbox::WriteFastJson(s, v);
-  
+  std::string s = "{}";
   OrthancPluginAnswerBuffer(context, output, s.c_str(), s.size(), "application/json");
 }
 
 
-static void MetadataThread()
+// Evicts one instance from the write-behind buffer of the series
+static void EvictInstance(const std::string& instanceId)
+{
+  pendingSeries_.RemoveInstance(instanceId);
+}
+
+
+// The DICOM file of the instance was replaced, so its OHIF metadata
+// is removed from the in-memory cache layers, and marked as outdated
+// in the record of its series. This runs on the thread of the changes
+// of Orthanc, so the REST API is not called: The instance is encoded
+// again by the preload workers, or by the next request for its study.
+static void RefreshInstance(const std::string& instanceId)
 {
-  while (continueThread_)
+  EvictInstance(instanceId);
+  aggregates_.InvalidateInstance(instanceId);
+  outdatedInstances_.Add(instanceId);
+
+  if (preloadWorkers_.IsRunning() &&
+      !pendingInstances_.Enqueue(instanceId))
   {
-    std::unique_ptr<Orthanc::IDynamicObject> instance(pendingInstances_.Dequeue(100));
-    if (instance.get() != NULL)
-    {
-      const std::string instanceId = dynamic_cast<Orthanc::SingleValueObject<std::string>&>(*instance).GetValue();
-      const std::string uri = GetCacheUri(instanceId);
+    aggregates_.Clear();
+  }
+}
+
+
+/**
+ * Maps the changes signaled by Orthanc to all the cache layers of the
+ * plugin (the write-behind buffer, the records of the series and
+ * their in-memory cache, and the study aggregates), and evicts
+ * exactly the entries that are affected by the change.
+ **/
+static void InvalidateCaches(OrthancPluginChangeType changeType,
+                             OrthancPluginResourceType resourceType,
+                             const std::string& resourceId)
+{
+  switch (changeType)
+  {
+    case OrthancPluginChangeType_Deleted:
+      selfWrites_.Forget(resourceId);
+      fingerprints_.NotifyWrite();
 
-      Json::Value instanceTags;
-      std::string metadata;
-      if (!OrthancPlugins::RestApiGetString(metadata, uri, false) &&
-          EncodeOhifInstance(instanceTags, instanceId))
+      // The "4202" metadata of the resource is deleted together with it
+      switch (resourceType)
       {
-        CacheAsMetadata(instanceTags, instanceId);
+        case OrthancPluginResourceType_Instance:
+          EvictInstance(resourceId);
+          outdatedInstances_.Remove(resourceId);
+          aggregates_.NotifyDeletedInstance(resourceId);
+          break;
+
+        case OrthancPluginResourceType_Series:
+          pendingSeries_.Discard(resourceId);
+          seriesRecords_.Invalidate(resourceId);
+          aggregates_.InvalidateParent(Orthanc::ResourceType_Series, resourceId);
+          break;
+
+        case OrthancPluginResourceType_Study:
+          aggregates_.Invalidate(resourceId);
+          break;
+
+        case OrthancPluginResourceType_Patient:
+          aggregates_.InvalidateParent(Orthanc::ResourceType_Patient, resourceId);
+          break;
+
+        default:
+          seriesRecords_.Clear();
+          aggregates_.Clear();
+          break;
       }
-    }
+
+      break;
+
+    case OrthancPluginChangeType_UpdatedAttachment:
+      fingerprints_.NotifyWrite();
+
+      if (resourceType == OrthancPluginResourceType_Instance)
+      {
+        RefreshInstance(resourceId);
+      }
+      break;
+
+    case OrthancPluginChangeType_UpdatedMetadata:
+      if (selfWrites_.Consume(resourceId))
+      {
+        break;  // Written by the plugin itself
+      }
+
+      // Someone else has modified the metadata of the resource,
+      // possibly including the "4202" metadata of the plugin
+      switch (resourceType)
+      {
+        case OrthancPluginResourceType_Series:
+          seriesRecords_.Invalidate(resourceId);
+          aggregates_.InvalidateParent(Orthanc::ResourceType_Series, resourceId);
+          break;
+
+        case OrthancPluginResourceType_Study:
+          aggregates_.Invalidate(resourceId);
+          break;
+
+        default:
+          break;
+      }
+
+      break;
+
+    default:
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
   }
 }
 
@@ -752,8 +4771,6 @@ OrthancPluginErrorCode OnChangeCallback(OrthancPluginChangeType changeType,
     {
       case OrthancPluginChangeType_OrthancStarted:
       {
-        continueThread_ = true;
-
         switch (dataSource_)
         {
           case DataSource_DicomWeb:
@@ -782,10 +4799,51 @@ OrthancPluginErrorCode OnChangeCallback(OrthancPluginChangeType changeType,
 
           case DataSource_DicomJson:
           {
+            if (upgradeMetadata_ &&
+                IsMetadataUpgradeNeeded())
+            {
+#if HAS_ORTHANC_PLUGIN_JOB == 1
+              const std::string job = OrthancPlugins::OrthancJob::Submit(new MetadataUpgradeJob(upgradeMetadataRate_), 0 /* priority */);
+              LOG(WARNING) << "Submitted job to upgrade the OHIF metadata to version " << METADATA_VERSION << ": " << job;
+#else
+              LOG(WARNING) << "Your version of the Orthanc SDK does not support jobs, "
+                           << "the OHIF metadata will be upgraded on-the-fly";
+#endif
+            }
+
+            if (preload_ &&
+                backfill_)
+            {
+#if HAS_ORTHANC_PLUGIN_JOB == 1
+              const std::string job = OrthancPlugins::OrthancJob::Submit(new MetadataBackfillJob(backfillThreads_), 0 /* priority */);
+              LOG(INFO) << "Submitted job to backfill the OHIF metadata: " << job;
+#else
+              LOG(WARNING) << "Your version of the Orthanc SDK does not support jobs, "
+                           << "the OHIF metadata will not be backfilled";
+#endif
+            }
+
+            fetchPool_.Start(fetchThreads_, fetchThreadsPerStudy_);
+
             if (preload_)
             {
-              metadataThread_ = boost::thread(MetadataThread);
-              LOG(INFO) << "Started the OHIF preload thread";
+              // The study aggregates can only be kept up-to-date if
+              // the preload thread is running
+              aggregates_.SetMaximumSize(maxStudyAggregates_);
+              
+              try
+              {
+                pendingInstances_.Open(preloadQueuePath_);
+              }
+              catch (Orthanc::OrthancException& e)
+              {
+                LOG(ERROR) << "Cannot open the spill log of the OHIF preload queue, "
+                           << "the instances will be dropped if the queue is full: " << e.What();
+                pendingInstances_.Open("");
+              }
+
+              preloadWorkers_.Start(preloadThreads_);
+              LOG(INFO) << "Started the OHIF preload threads: " << preloadThreads_;
             }
             else
             {
@@ -803,27 +4861,61 @@ OrthancPluginErrorCode OnChangeCallback(OrthancPluginChangeType changeType,
 
       case OrthancPluginChangeType_OrthancStopped:
       {
-        continueThread_ = false;
-
-        if (metadataThread_.joinable())
+        if (preloadWorkers_.IsRunning())
         {
-          LOG(INFO) << "Stopping the OHIF preload thread";
-          metadataThread_.join();
+          LOG(INFO) << "Stopping the OHIF preload threads";
+          preloadWorkers_.Stop();
+          FlushPendingSeries(true);
+          pendingInstances_.Close();
         }
+
+        fetchPool_.Stop();
         break;
       }
 
       case OrthancPluginChangeType_NewInstance:
       {
-        if (metadataThread_.joinable() &&
-            pendingInstances_.GetSize() < MAX_INSTANCES_IN_QUEUE) /* avoid overwhelming Orthanc */
+        // The instance might have been received again after deletion,
+        // or overwritten by a modified version
+        fingerprints_.NotifyWrite();
+        EvictInstance(resourceId);
+
+        if (preloadWorkers_.IsRunning())
         {
-          pendingInstances_.Enqueue(new Orthanc::SingleValueObject<std::string>(resourceId));
+          // If the in-memory queue is full, the instance is
+          // appended to the spill log so as not to overwhelm Orthanc
+          if (!pendingInstances_.Enqueue(resourceId))
+          {
+            // The parent study of the dropped instance is unknown,
+            // so none of the aggregates can be trusted anymore
+            aggregates_.Clear();
+          }
         }
 
         break;
       }
 
+      case OrthancPluginChangeType_StableStudy:
+        if (preloadWorkers_.IsRunning())
+        {
+          pendingInstances_.EnqueuePrecompile(resourceId);
+        }
+        break;
+
+      case OrthancPluginChangeType_StableSeries:
+        if (preloadWorkers_.IsRunning())
+        {
+          // Write the pending metadata of the series to the disk
+          pendingInstances_.EnqueueSeries(resourceId);
+        }
+        break;
+
+      case OrthancPluginChangeType_Deleted:
+      case OrthancPluginChangeType_UpdatedAttachment:
+      case OrthancPluginChangeType_UpdatedMetadata:
+        InvalidateCaches(changeType, resourceType, resourceId);
+        break;
+
       default:
         break;
     }
@@ -872,12 +4964,63 @@ extern "C"
       {
         OrthancPlugins::OrthancConfiguration globalConfiguration;
         globalConfiguration.GetSection(configuration, "OHIF");
+
+        // If the HTTP server of Orthanc compresses the answers by
+        // itself, it does not check whether an answer is already
+        // compressed: The answers of the plugin must then be sent
+        // uncompressed, so that they are not compressed twice
+        const bool compress = configuration.GetBooleanValue("CompressDicomJson", true);
+        const bool httpCompression = globalConfiguration.GetBooleanValue("HttpCompressionEnabled", true);
+        compressDicomJson_ = (compress && !httpCompression);
+
+        if (compress && httpCompression)
+        {
+          LOG(WARNING) << "As \"HttpCompressionEnabled\" is true, the option \"CompressDicomJson\" of the OHIF "
+                       << "plugin has no effect: The precompressed OHIF DICOM-JSON documents are uncompressed, then "
+                       << "compressed again by Orthanc at each request. Set \"HttpCompressionEnabled\" to false "
+                       << "to send them as such";
+        }
+
+        // By default, the spill log of the preload queue is stored
+        // next to the DICOM files
+        preloadQueuePath_ = (globalConfiguration.GetStringValue("StorageDirectory", "OrthancStorage") +
+                             "/ohif-preload-queue.txt");
       }
 
       routerBasename_ = configuration.GetStringValue("RouterBasename", "/ohif/");
       std::string s = configuration.GetStringValue("DataSource", "dicom-json");
       std::string userConfigurationPath = configuration.GetStringValue("UserConfiguration", "");
       preload_ = configuration.GetBooleanValue("Preload", true);
+      maxStudyAggregates_ = configuration.GetUnsignedIntegerValue("StudyAggregatesCacheSize", 10);
+      fingerprints_.SetMaximumSize(configuration.GetUnsignedIntegerValue("StudyFingerprintsCacheSize", STUDY_FINGERPRINTS));
+
+      {
+        const unsigned int size = configuration.GetUnsignedIntegerValue("InstancesCacheSize", 64);  // In MB
+        seriesRecords_.SetMaximumMemoryUsage(static_cast<size_t>(size) * 1024 * 1024);
+      }
+
+      upgradeMetadata_ = configuration.GetBooleanValue("UpgradeMetadata", true);
+      upgradeMetadataRate_ = configuration.GetUnsignedIntegerValue("UpgradeMetadataRate", 100);  // Instances per second
+      preloadThreads_ = configuration.GetUnsignedIntegerValue("PreloadThreads", 2);
+      preloadThrottle_.SetMaximum(preloadThreads_, configuration.GetUnsignedIntegerValue("PreloadBatchSize", 100));
+      preloadThrottle_.SetTargets(configuration.GetUnsignedIntegerValue("ThrottleRestLatency", 100),     // In milliseconds
+                                  configuration.GetUnsignedIntegerValue("ThrottleViewerLatency", 2000));  // In milliseconds
+      preloadThrottle_.SetBusinessHours(configuration.GetStringValue("BusinessHours", ""),
+                                        configuration.GetUnsignedIntegerValue("BusinessHoursThreads", 1),
+                                        configuration.GetUnsignedIntegerValue("BusinessHoursBatchSize", 10));
+      preloadQueuePath_ = configuration.GetStringValue("PreloadQueuePath", preloadQueuePath_);
+      backfill_ = configuration.GetBooleanValue("Backfill", true);
+      backfillThreads_ = configuration.GetUnsignedIntegerValue("BackfillThreads", 2);
+      fetchThreads_ = configuration.GetUnsignedIntegerValue("FetchThreads", 4);
+      fetchThreadsPerStudy_ = configuration.GetUnsignedIntegerValue("FetchThreadsPerStudy", 2);
+
+      {
+        const unsigned int timeout = configuration.GetUnsignedIntegerValue("AdmissionTimeout", 30);  // In seconds
+        cachedRequests_.SetLimits(configuration.GetUnsignedIntegerValue("MaxConcurrentCachedRequests", 16),
+                                  configuration.GetUnsignedIntegerValue("MaxQueuedCachedRequests", 64), timeout);
+        generations_.SetLimits(configuration.GetUnsignedIntegerValue("MaxConcurrentGenerations", 4),
+                               configuration.GetUnsignedIntegerValue("MaxQueuedGenerations", 16), timeout);
+      }
 
       if (s == "dicom-web")
       {
@@ -915,6 +5058,8 @@ extern "C"
       OrthancPlugins::RegisterRestCallback<ServeFile>("/ohif", true);
       OrthancPlugins::RegisterRestCallback<ServeFile>("/ohif/(.*)", true);
       OrthancPlugins::RegisterRestCallback<GetOhifStudy>("/studies/([0-9a-f-]+)/ohif-dicom-json", true);
+      OrthancPlugins::RegisterRestCallback<PreloadOhifStudy>("/studies/([0-9a-f-]+)/ohif-preload", true);
+      OrthancPlugins::RegisterRestCallback<GetOhifSeries>("/series/([0-9a-f-]+)/ohif-dicom-json", true);
 
       OrthancPluginRegisterOnChangeCallback(context, OnChangeCallback);
 
@@ -0,0 +1,904 @@
+/**
+ * SPDX-FileCopyrightText: 2023 Sebastien Jodogne, UCLouvain, Belgium
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/**
+ * OHIF plugin for Orthanc
+ * Copyright (C) 2023 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#include "PreloadQueue.h"
+
+#include <Logging.h>
+#include <OrthancException.h>
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+#include <algorithm>
+#include <cassert>
+#include <limits>
+
+
+static const uint64_t  DEFAULT_SEGMENT_SIZE = 10000;  // Instances
+
+
+const uint64_t PreloadQueue::NO_SEGMENT;
+
+
+std::string PreloadQueue::GetSegmentPath(uint64_t number) const
+{
+  return path_ + "." + boost::lexical_cast<std::string>(number);
+}
+
+
+size_t PreloadQueue::GetBulkSize() const
+{
+  // The mutex must be locked
+  return lanes_[PreloadPriority_Normal].size() + lanes_[PreloadPriority_Low].size();
+}
+
+
+void PreloadQueue::AddLive(uint64_t segment)
+{
+  // The mutex must be locked
+  if (segment != NO_SEGMENT)
+  {
+    live_.insert(segment);
+  }
+}
+
+
+void PreloadQueue::RemoveLive(uint64_t segment)
+{
+  // The mutex must be locked
+  if (segment != NO_SEGMENT)
+  {
+    std::multiset<uint64_t>::iterator found = live_.find(segment);
+    assert(found != live_.end());
+
+    if (found != live_.end())
+    {
+      live_.erase(found);
+    }
+  }
+}
+
+
+void PreloadQueue::Raise(Location& location,
+                         PreloadPriority priority)
+{
+  // The mutex must be locked
+  
+  if (priority < location.priority_)
+  {
+    // Move the item to the end of the lane with the higher priority,
+    // which does not invalidate the iterator
+    lanes_[priority].splice(lanes_[priority].end(), lanes_[location.priority_], location.position_);
+    location.priority_ = priority;
+  }
+}
+
+
+void PreloadQueue::Push(const Item& item,
+                        PreloadPriority priority)
+{
+  // The mutex must be locked
+
+  Index::iterator found = index_.find(item.GetId());
+  
+  if (found == index_.end())
+  {
+    Lane& lane = lanes_[priority];
+    lane.push_back(item);
+
+    Location location;
+    location.priority_ = priority;
+    location.position_ = --lane.end();
+    index_[item.GetId()] = location;
+
+    AddLive(item.GetSegment());
+  }
+  else
+  {
+    Item& queued = *found->second.position_;
+    queued.AddInstances(item.GetInstances());
+
+    if (item.IsPrecompile())
+    {
+      queued.SetPrecompile(true);
+    }
+
+    if (item.GetSegment() < queued.GetSegment())
+    {
+      RemoveLive(queued.GetSegment());
+      queued.SetSegment(item.GetSegment());
+      AddLive(item.GetSegment());
+    }
+
+    Raise(found->second, priority);
+  }
+}
+
+
+bool PreloadQueue::Pop(Item& item)
+{
+  // The mutex must be locked
+
+  for (size_t i = 0; i < LANES; i++)
+  {
+    if (!lanes_[i].empty())
+    {
+      item = lanes_[i].front();
+      index_.erase(item.GetId());
+      lanes_[i].pop_front();
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+void PreloadQueue::StartSegment()
+{
+  // The mutex must be locked
+
+  Segment segment;
+  segment.number_ = (segments_.empty() ? 0 : segments_.back().number_ + 1);
+  segment.count_ = 0;
+
+  writer_.close();
+  writer_.open(GetSegmentPath(segment.number_).c_str(), std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
+
+  if (writer_.is_open())
+  {
+    segments_.push_back(segment);
+
+    if (spilled_ == 0)
+    {
+      // The spill log was fully read
+      readSegment_ = segment.number_;
+      readOffset_ = 0;
+    }
+  }
+  else
+  {
+    LOG(ERROR) << "Cannot write the OHIF preload spill log, the queue is not durable anymore: "
+               << GetSegmentPath(segment.number_);
+  }
+}
+
+
+void PreloadQueue::ReadSpillLog(std::list<Item>& target,
+                                size_t count)
+{
+  // The mutex must be locked
+
+  while (target.size() < count &&
+         spilled_ > 0)
+  {
+    const std::string path = GetSegmentPath(readSegment_);
+
+    std::ifstream reader(path.c_str(), std::ifstream::in | std::ifstream::binary);
+    if (!reader.is_open())
+    {
+      throw Orthanc::OrthancException(Orthanc::ErrorCode_InexistentFile,
+                                      "Cannot read the OHIF preload spill log: " + path);
+    }
+
+    reader.seekg(readOffset_);
+
+    std::string line;
+    while (target.size() < count &&
+           std::getline(reader, line))
+    {
+      if (!line.empty())
+      {
+        Item item(Orthanc::ResourceType_Instance, line);
+        item.SetSegment(readSegment_);
+        target.push_back(item);
+        spilled_--;
+      }
+
+      const std::streamoff position = reader.tellg();
+      if (position < 0)
+      {
+        // The last line was not terminated by a newline (e.g. crash during a write)
+        reader.clear();
+        reader.seekg(0, std::ifstream::end);
+        readOffset_ = reader.tellg();
+        break;
+      }
+      else
+      {
+        readOffset_ = position;
+      }
+
+      if (spilled_ == 0)
+      {
+        break;
+      }
+    }
+
+    if (target.size() < count &&
+        spilled_ > 0)
+    {
+      // End of the segment: Go to the next one
+      bool found = false;
+      for (size_t i = 0; i + 1 < segments_.size(); i++)
+      {
+        if (segments_[i].number_ == readSegment_)
+        {
+          readSegment_ = segments_[i + 1].number_;
+          readOffset_ = 0;
+          found = true;
+          break;
+        }
+      }
+
+      if (!found)
+      {
+        spilled_ = 0;  // End of the spill log
+      }
+    }
+  }
+
+  if (spilled_ == 0 &&
+      !segments_.empty() &&
+      readSegment_ != segments_.back().number_)
+  {
+    // The next segments only contain empty lines: Go to the end of
+    // the last segment, where the next identifier will be written
+    readSegment_ = segments_.back().number_;
+
+    boost::system::error_code error;
+    const boost::uintmax_t size = boost::filesystem::file_size(GetSegmentPath(readSegment_), error);
+    readOffset_ = (error ? 0 : static_cast<std::streamoff>(size));
+  }
+}
+
+
+void PreloadQueue::Refill()
+{
+  // The mutex must be locked
+  
+  if (spilled_ == 0 ||
+      !writer_.is_open())
+  {
+    return;
+  }
+
+  writer_.flush();
+
+  const size_t size = GetBulkSize();
+
+  std::list<Item> items;
+  ReadSpillLog(items, size < maxSize_ ? maxSize_ - size : 0);
+
+  for (std::list<Item>::const_iterator it = items.begin(); it != items.end(); ++it)
+  {
+    Push(*it, PreloadPriority_Low);
+  }
+
+  // The segments that were read are not deleted here, as their
+  // instances are not processed yet: This is the job of "Checkpoint()"
+}
+
+
+void PreloadQueue::DeleteSegments(uint64_t end)
+{
+  // The mutex must be locked. The segment being written is never deleted.
+  while (segments_.size() > 1 &&
+         segments_.front().number_ < end)
+  {
+    boost::system::error_code error;
+    boost::filesystem::remove(GetSegmentPath(segments_.front().number_), error);
+
+    if (error)
+    {
+      LOG(WARNING) << "Cannot delete a segment of the OHIF preload spill log: "
+                   << GetSegmentPath(segments_.front().number_);
+    }
+
+    segments_.pop_front();
+  }
+}
+
+
+PreloadQueue::PreloadQueue(size_t maxSize) :
+  maxSize_(maxSize),
+  segmentSize_(DEFAULT_SEGMENT_SIZE),
+  readSegment_(0),
+  readOffset_(0),
+  spilled_(0),
+  hasCheckpoint_(false),
+  checkpointSegment_(0),
+  checkpointMark_(0),
+  stopped_(false)
+{
+  if (maxSize == 0)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+}
+
+
+PreloadQueue::~PreloadQueue()
+{
+  try
+  {
+    Close();
+  }
+  catch (Orthanc::OrthancException&)
+  {
+  }
+}
+
+
+void PreloadQueue::SetSegmentSize(uint64_t size)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  if (size == 0)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+  else if (writer_.is_open())
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+  }
+  else
+  {
+    segmentSize_ = size;
+  }
+}
+
+
+void PreloadQueue::Open(const std::string& path)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  if (writer_.is_open())
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_BadSequenceOfCalls);
+  }
+
+  path_ = path;
+  segments_.clear();
+  readSegment_ = 0;
+  readOffset_ = 0;
+  spilled_ = 0;
+  live_.clear();
+  hasCheckpoint_ = false;
+  stopped_ = false;
+
+  if (path.empty())
+  {
+    return;
+  }
+
+  // Look for the segments that were left by the previous execution
+  const boost::filesystem::path log(path);
+  const std::string prefix = log.filename().string() + ".";
+
+  boost::filesystem::path directory = log.parent_path();
+  if (directory.empty())
+  {
+    directory = ".";
+  }
+
+  std::set<uint64_t> numbers;
+
+  if (boost::filesystem::is_directory(directory))
+  {
+    for (boost::filesystem::directory_iterator it(directory);
+         it != boost::filesystem::directory_iterator(); ++it)
+    {
+      const std::string name = it->path().filename().string();
+      if (name.size() > prefix.size() &&
+          name.compare(0, prefix.size(), prefix) == 0 &&
+          name.find_first_not_of("0123456789", prefix.size()) == std::string::npos)
+      {
+        try
+        {
+          numbers.insert(boost::lexical_cast<uint64_t>(name.substr(prefix.size())));
+        }
+        catch (boost::bad_lexical_cast&)
+        {
+        }
+      }
+    }
+  }
+
+  bool terminated = true;
+
+  for (std::set<uint64_t>::const_iterator it = numbers.begin(); it != numbers.end(); ++it)
+  {
+    Segment segment;
+    segment.number_ = *it;
+    segment.count_ = 0;
+
+    std::ifstream reader(GetSegmentPath(*it).c_str(), std::ifstream::in | std::ifstream::binary);
+
+    std::string line;
+    terminated = true;
+    while (std::getline(reader, line))
+    {
+      if (!line.empty())
+      {
+        segment.count_++;
+      }
+
+      terminated = !reader.eof();
+    }
+
+    segments_.push_back(segment);
+    spilled_ += segment.count_;
+  }
+
+  if (segments_.empty())
+  {
+    StartSegment();
+  }
+  else
+  {
+    // Replay the spill log, then append to its last segment
+    if (spilled_ > 0)
+    {
+      LOG(WARNING) << "Replaying " << spilled_ << " instances from the OHIF preload spill log: " << path;
+    }
+
+    readSegment_ = segments_.front().number_;
+
+    writer_.open(GetSegmentPath(segments_.back().number_).c_str(),
+                 std::ofstream::out | std::ofstream::binary | std::ofstream::app);
+
+    if (!terminated &&
+        writer_.is_open())
+    {
+      // Orthanc crashed while writing the last line: Terminate it, so
+      // that it is not merged with the next identifier
+      writer_ << "\n";
+    }
+  }
+
+  if (!writer_.is_open())
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_CannotWriteFile,
+                                    "Cannot write the OHIF preload spill log: " + path);
+  }
+
+  Refill();
+}
+
+
+void PreloadQueue::Close()
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  // Rewrite the spill log, so that it only contains the instances
+  // that are still in the in-memory queue, by order of priority,
+  // followed by the unread instances of the spill log. The instances
+  // that were coalesced into a study are saved individually. The
+  // other studies and the series are dropped, as they are only hints.
+  std::list<std::string> pending;
+
+  Item item(Orthanc::ResourceType_Instance, "");
+  while (Pop(item))
+  {
+    if (item.GetLevel() == Orthanc::ResourceType_Instance)
+    {
+      pending.push_back(item.GetId());
+    }
+    else
+    {
+      pending.insert(pending.end(), item.GetInstances().begin(), item.GetInstances().end());
+    }
+  }
+
+  live_.clear();
+  hasCheckpoint_ = false;
+
+  if (!writer_.is_open())
+  {
+    return;
+  }
+
+  writer_.flush();
+
+  std::list<Item> unread;
+  ReadSpillLog(unread, std::numeric_limits<size_t>::max());
+
+  for (std::list<Item>::const_iterator it = unread.begin(); it != unread.end(); ++it)
+  {
+    pending.push_back(it->GetId());
+  }
+
+  // The pending instances are written into a new segment before
+  // deleting the previous ones, so that a crash loses nothing
+  writer_.close();
+
+  const uint64_t number = (segments_.empty() ? 0 : segments_.back().number_ + 1);
+  writer_.open(GetSegmentPath(number).c_str(), std::ofstream::out | std::ofstream::binary | std::ofstream::trunc);
+
+  if (!writer_.is_open())
+  {
+    LOG(ERROR) << "Cannot save the pending instances into the OHIF preload spill log: " << GetSegmentPath(number);
+    segments_.clear();
+    return;
+  }
+
+  for (std::list<std::string>::const_iterator it = pending.begin(); it != pending.end(); ++it)
+  {
+    writer_ << *it << "\n";
+  }
+
+  writer_.close();
+
+  Segment segment;
+  segment.number_ = number;
+  segment.count_ = pending.size();
+  segments_.push_back(segment);
+  DeleteSegments(number);
+
+  if (!pending.empty())
+  {
+    LOG(WARNING) << "Saved " << pending.size() << " pending instances into the OHIF preload spill log: " << path_;
+  }
+
+  segments_.clear();
+  readOffset_ = 0;
+  spilled_ = 0;
+}
+
+
+bool PreloadQueue::Enqueue(const std::string& instanceId)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  if (index_.find(instanceId) != index_.end())
+  {
+    return true;  // Already queued in memory
+  }
+
+  if (writer_.is_open() &&
+      segments_.back().count_ >= segmentSize_)
+  {
+    StartSegment();
+  }
+
+  if (writer_.is_open())
+  {
+    // Each accepted instance is appended to the spill log, so that it
+    // survives a crash. The spill log is not deduplicated, so as to
+    // keep the memory bounded: An instance that is spilled twice is
+    // simply preloaded twice.
+    writer_ << instanceId << "\n";
+    writer_.flush();
+    segments_.back().count_++;
+
+    if (spilled_ == 0 &&
+        GetBulkSize() < maxSize_)
+    {
+      // The log was fully read: The new identifier is the last line
+      // of the last segment, which is read back immediately
+      assert(readSegment_ == segments_.back().number_);
+      readOffset_ += static_cast<std::streamoff>(instanceId.size() + 1);
+
+      Item item(Orthanc::ResourceType_Instance, instanceId);
+      item.SetSegment(readSegment_);
+      Push(item, PreloadPriority_Normal);
+      elementAvailable_.notify_one();
+    }
+    else
+    {
+      // Reading the spill log in order as soon as it is not fully
+      // read preserves the FIFO order
+      spilled_++;
+    }
+
+    return true;
+  }
+  else if (GetBulkSize() < maxSize_)
+  {
+    Push(Item(Orthanc::ResourceType_Instance, instanceId), PreloadPriority_Normal);
+    elementAvailable_.notify_one();
+    return true;
+  }
+  else
+  {
+    return false;
+  }
+}
+
+
+void PreloadQueue::Stop()
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  stopped_ = true;
+  elementAvailable_.notify_all();
+}
+
+
+bool PreloadQueue::IsStopped()
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  return stopped_;
+}
+
+
+void PreloadQueue::EnqueueSeries(const std::string& seriesId)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  Push(Item(Orthanc::ResourceType_Series, seriesId), PreloadPriority_Normal);
+  elementAvailable_.notify_one();
+}
+
+
+void PreloadQueue::Requeue(const Item& item)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  Push(item, (item.GetLevel() == Orthanc::ResourceType_Study ? PreloadPriority_High : PreloadPriority_Normal));
+  elementAvailable_.notify_one();
+}
+
+
+void PreloadQueue::EnqueueStudy(const std::string& studyId)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  Push(Item(Orthanc::ResourceType_Study, studyId), PreloadPriority_High);
+  elementAvailable_.notify_one();
+}
+
+
+void PreloadQueue::EnqueuePrecompile(const std::string& studyId)
+{
+  Item study(Orthanc::ResourceType_Study, studyId);
+  study.SetPrecompile(true);
+
+  boost::mutex::scoped_lock lock(mutex_);
+  Push(study, PreloadPriority_Normal);
+  elementAvailable_.notify_one();
+}
+
+
+bool PreloadQueue::Coalesce(const std::string& studyId,
+                            const std::list<std::string>& instancesIds,
+                            size_t minimum)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  std::list<Index::iterator> queued;
+
+  for (std::list<std::string>::const_iterator it = instancesIds.begin(); it != instancesIds.end(); ++it)
+  {
+    Index::iterator found = index_.find(*it);
+    if (found != index_.end() &&
+        found->second.position_->GetLevel() == Orthanc::ResourceType_Instance)
+    {
+      queued.push_back(found);
+    }
+  }
+
+  if (queued.empty() ||
+      queued.size() < minimum)
+  {
+    return false;
+  }
+
+  // The study inherits the highest priority of its instances
+  Item study(Orthanc::ResourceType_Study, studyId);
+  PreloadPriority priority = PreloadPriority_Low;
+
+  for (std::list<Index::iterator>::const_iterator it = queued.begin(); it != queued.end(); ++it)
+  {
+    const Location& location = (*it)->second;
+    priority = std::min(priority, location.priority_);
+    study.AddInstance((*it)->first);
+    study.SetSegment(std::min(study.GetSegment(), location.position_->GetSegment()));
+    RemoveLive(location.position_->GetSegment());
+    lanes_[location.priority_].erase(location.position_);
+    index_.erase(*it);
+  }
+
+  Push(study, priority);
+  elementAvailable_.notify_one();
+  return true;
+}
+
+
+void PreloadQueue::Uncoalesce(const Item& study)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  for (std::set<std::string>::const_iterator it = study.GetInstances().begin(); it != study.GetInstances().end(); ++it)
+  {
+    // The instances are still in the segments of the spill log of the study
+    Item instance(Orthanc::ResourceType_Instance, *it);
+    instance.SetSegment(study.GetSegment());
+    Push(instance, PreloadPriority_Low);
+  }
+
+  elementAvailable_.notify_all();
+}
+
+
+size_t PreloadQueue::Promote(const std::list<std::string>& instancesIds)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  size_t count = 0;
+
+  for (std::list<std::string>::const_iterator it = instancesIds.begin(); it != instancesIds.end(); ++it)
+  {
+    Index::iterator found = index_.find(*it);
+    if (found != index_.end() &&
+        found->second.priority_ != PreloadPriority_High)
+    {
+      // The queued item is moved as such, there is nothing to merge
+      Raise(found->second, PreloadPriority_High);
+      count++;
+    }
+  }
+
+  return count;
+}
+
+
+bool PreloadQueue::DequeueBatch(std::vector<Item>& items,
+                                size_t maxCount,
+                                int32_t millisecondsTimeout)
+{
+  items.clear();
+
+  boost::mutex::scoped_lock lock(mutex_);
+
+  if (GetBulkSize() <= maxSize_ / 2)
+  {
+    Refill();
+  }
+
+  if (millisecondsTimeout == 0)
+  {
+    while (index_.empty() &&
+           !stopped_)
+    {
+      elementAvailable_.wait(lock);
+    }
+  }
+  else
+  {
+    const boost::system_time timeout = (boost::get_system_time() +
+                                        boost::posix_time::milliseconds(millisecondsTimeout));
+
+    while (index_.empty() &&
+           !stopped_ &&
+           elementAvailable_.timed_wait(lock, timeout))
+    {
+    }
+  }
+
+  if (stopped_)
+  {
+    return false;
+  }
+
+  Item item(Orthanc::ResourceType_Instance, "");
+  while (items.size() < maxCount &&
+         Pop(item))
+  {
+    items.push_back(item);
+  }
+
+  // The items remain in "live_" until they are acknowledged
+  return !items.empty();
+}
+
+
+void PreloadQueue::Acknowledge(const std::vector<Item>& items)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  for (size_t i = 0; i < items.size(); i++)
+  {
+    RemoveLive(items[i].GetSegment());
+  }
+}
+
+
+bool PreloadQueue::Checkpoint(IWriteBehindBuffer& buffer)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  if (!writer_.is_open())
+  {
+    return false;
+  }
+
+  if (!hasCheckpoint_)
+  {
+    if (spilled_ == 0 &&
+        live_.empty() &&
+        segments_.back().count_ > 0)
+    {
+      // All the instances of the spill log are acknowledged: Start a
+      // new segment, so that the current one can be deleted
+      StartSegment();
+    }
+
+    // The segments before the one being read, and before the oldest
+    // segment of the queued or unacknowledged items, are not needed
+    // anymore as soon as the results of their instances are stored.
+    // A consumer adds its results to the buffer before acknowledging
+    // its items, so these results are covered by the current mark.
+    uint64_t end = readSegment_;
+    if (!live_.empty())
+    {
+      end = std::min(end, *live_.begin());
+    }
+
+    if (end > segments_.front().number_)
+    {
+      hasCheckpoint_ = true;
+      checkpointSegment_ = end;
+      checkpointMark_ = buffer.GetAddedMark();
+    }
+  }
+
+  if (hasCheckpoint_ &&
+      buffer.IsStored(checkpointMark_))
+  {
+    DeleteSegments(checkpointSegment_);
+    hasCheckpoint_ = false;
+    return true;
+  }
+  else
+  {
+    return false;
+  }
+}
+
+
+size_t PreloadQueue::GetSize()
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  return index_.size();
+}
+
+
+size_t PreloadQueue::GetSize(PreloadPriority priority)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  return lanes_[priority].size();
+}
+
+
+uint64_t PreloadQueue::GetSpilledCount()
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  return spilled_;
+}
+
+
+size_t PreloadQueue::GetSegmentsCount()
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  return segments_.size();
+}
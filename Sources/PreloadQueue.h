@@ -0,0 +1,313 @@
+/**
+ * SPDX-FileCopyrightText: 2023 Sebastien Jodogne, UCLouvain, Belgium
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/**
+ * OHIF plugin for Orthanc
+ * Copyright (C) 2023 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <Enumerations.h>
+
+#include <boost/noncopyable.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <deque>
+#include <fstream>
+#include <list>
+#include <map>
+#include <set>
+#include <stdint.h>
+#include <vector>
+
+
+enum PreloadPriority
+{
+  PreloadPriority_High = 0,    // Studies that are requested by the viewer
+  PreloadPriority_Normal = 1,  // Instances that were just received
+  PreloadPriority_Low = 2      // Bulk work, i.e. instances read back from the spill log
+};
+
+
+/**
+ * Multi-level priority queue of the Orthanc resources whose OHIF
+ * metadata must be preloaded. The items are dequeued by order of
+ * priority, then in FIFO order, and a resource is queued at most
+ * once in memory. The queued instances of one study can be coalesced
+ * into a single study-level item. The consumers are blocked on a
+ * condition variable until an item is available or until the queue
+ * is stopped. At most "maxSize" instances of normal or low priority
+ * are kept in memory.
+ *
+ * If a spill log is opened, each accepted instance is appended to
+ * this log on the disk. The instances that do not fit in memory are
+ * read back from the log with a low priority as soon as the in-memory
+ * queue drains. The log is made of numbered segments (files whose
+ * name is the path of the log followed by the number of the
+ * segment), and a new segment is started once the current one is
+ * full. "Checkpoint()" deletes the oldest segments once all their
+ * instances have been processed and stored, even if the queue is
+ * never idle, so that no instance is lost if the process of Orthanc
+ * crashes. The log is flushed after each instance, but it is not
+ * synchronized to the disk: A crash of the host may lose the most
+ * recent instances. On shutdown, the log is rewritten with the
+ * instances of the in-memory queue (including the coalesced ones)
+ * and the unread instances, and it is replayed on the next startup.
+ * The instances that were processed since the last checkpoint might
+ * be processed a second time after a crash, which is harmless as
+ * preloading is idempotent.
+ **/
+class PreloadQueue : public boost::noncopyable
+{
+public:
+  /**
+   * Buffer where the consumers keep the results of the processed
+   * items before storing them. The segments of the spill log must be
+   * kept as long as the results of their instances are not stored.
+   **/
+  class IWriteBehindBuffer : public boost::noncopyable
+  {
+  public:
+    virtual ~IWriteBehindBuffer()
+    {
+    }
+
+    // Returns a mark that covers all the results added so far
+    virtual uint64_t GetAddedMark() = 0;
+
+    // Tells whether all the results up to the given mark are stored
+    virtual bool IsStored(uint64_t mark) = 0;
+  };
+
+  // Segment of the items that are not read from the spill log
+  static const uint64_t NO_SEGMENT = static_cast<uint64_t>(-1);
+
+  class Item
+  {
+  private:
+    Orthanc::ResourceType  level_;
+    std::string            id_;
+    std::set<std::string>  instances_;
+    bool                   precompile_;
+    uint64_t               segment_;  // Oldest segment of the spill log that holds the instances of the item
+
+  public:
+    Item(Orthanc::ResourceType level,
+         const std::string& id) :
+      level_(level),
+      id_(id),
+      precompile_(false),
+      segment_(NO_SEGMENT)
+    {
+    }
+
+    Orthanc::ResourceType GetLevel() const
+    {
+      return level_;
+    }
+
+    const std::string& GetId() const
+    {
+      return id_;
+    }
+
+    // For studies, the instances whose metadata must be refreshed
+    const std::set<std::string>& GetInstances() const
+    {
+      return instances_;
+    }
+
+    void AddInstance(const std::string& instanceId)
+    {
+      instances_.insert(instanceId);
+    }
+
+    void AddInstances(const std::set<std::string>& instances)
+    {
+      instances_.insert(instances.begin(), instances.end());
+    }
+
+    // For studies, whether the DICOM-JSON document must be persisted
+    bool IsPrecompile() const
+    {
+      return precompile_;
+    }
+
+    void SetPrecompile(bool precompile)
+    {
+      precompile_ = precompile;
+    }
+
+    uint64_t GetSegment() const
+    {
+      return segment_;
+    }
+
+    void SetSegment(uint64_t segment)
+    {
+      segment_ = segment;
+    }
+  };
+
+private:
+  static const size_t LANES = 3;
+
+  typedef std::list<Item>  Lane;
+
+  struct Location
+  {
+    PreloadPriority  priority_;
+    Lane::iterator   position_;
+  };
+
+  typedef std::map<std::string, Location>  Index;  // Orthanc ID => position in the lanes
+
+  struct Segment
+  {
+    uint64_t  number_;
+    uint64_t  count_;  // Number of identifiers that were written into the segment
+  };
+
+  boost::mutex                  mutex_;
+  boost::condition_variable     elementAvailable_;
+  Lane                          lanes_[LANES];
+  Index                         index_;
+  size_t                        maxSize_;
+  uint64_t                      segmentSize_;
+  std::string                   path_;
+  std::deque<Segment>           segments_;    // From the oldest to the one being written
+  std::ofstream                 writer_;
+  uint64_t                      readSegment_;
+  std::streamoff                readOffset_;  // Position in the segment being read
+  uint64_t                      spilled_;     // Number of unread identifiers in the spill log
+  std::multiset<uint64_t>       live_;        // Segments of the queued and of the unacknowledged items
+  bool                          hasCheckpoint_;
+  uint64_t                      checkpointSegment_;  // The segments before this one can be deleted...
+  uint64_t                      checkpointMark_;     // ... once the buffer has stored the results up to this mark
+  bool                          stopped_;
+
+  std::string GetSegmentPath(uint64_t number) const;
+
+  size_t GetBulkSize() const;
+
+  void AddLive(uint64_t segment);
+
+  void RemoveLive(uint64_t segment);
+
+  void Raise(Location& location,
+             PreloadPriority priority);
+
+  void Push(const Item& item,
+            PreloadPriority priority);
+
+  bool Pop(Item& item);
+
+  void StartSegment();
+
+  void Refill();
+
+  void ReadSpillLog(std::list<Item>& target,
+                    size_t count);
+
+  void DeleteSegments(uint64_t end);
+
+public:
+  explicit PreloadQueue(size_t maxSize);
+
+  ~PreloadQueue();
+
+  // Number of instances after which a new segment of the spill log is
+  // started. Must be called before "Open()".
+  void SetSegmentSize(uint64_t size);
+
+  // If "path" is empty, no spill log is used, the identifiers that do
+  // not fit in memory are dropped, and the queue is not durable
+  void Open(const std::string& path);
+
+  void Close();
+
+  // Wakes up the consumers, that stop dequeuing items. The pending
+  // items are kept until "Close()" is called.
+  void Stop();
+
+  bool IsStopped();
+
+  // Returns "false" iff the instance was dropped
+  bool Enqueue(const std::string& instanceId);
+
+  // The studies are never spilled to the disk
+  void EnqueueStudy(const std::string& studyId);
+
+  // Requests the DICOM-JSON document of one study that has become
+  // stable to be precompiled. This is bulk work, as opposed to the
+  // studies that are requested by the viewer.
+  void EnqueuePrecompile(const std::string& studyId);
+
+  // Requests the metadata of one series to be written to the disk.
+  // The series are never spilled to the disk.
+  void EnqueueSeries(const std::string& seriesId);
+
+  // Puts back an item that was dequeued, but not processed
+  void Requeue(const Item& item);
+
+  // Replaces the instances of the given study that are queued in
+  // memory by a single study-level item, if there are at least
+  // "minimum" such instances. Returns "true" iff coalesced.
+  bool Coalesce(const std::string& studyId,
+                const std::list<std::string>& instancesIds,
+                size_t minimum);
+
+  // Puts back the instances of a study-level item returned by
+  // "Coalesce()" whose processing has failed, as individual instances
+  // of low priority, so that a failure only drops the faulty ones
+  void Uncoalesce(const Item& study);
+
+  // Raises the priority of the given instances if they are queued in
+  // memory. Returns the number of promoted instances.
+  size_t Promote(const std::list<std::string>& instancesIds);
+
+  // Waits for a first item, then drains the items that are
+  // immediately available, up to "maxCount". Returns "false" on
+  // timeout, or if the queue is stopped. A timeout of zero means
+  // waiting forever.
+  bool DequeueBatch(std::vector<Item>& items,
+                    size_t maxCount,
+                    int32_t millisecondsTimeout);
+
+  // Signals that the given items returned by "DequeueBatch()" were
+  // processed, or put back with "Requeue()"
+  void Acknowledge(const std::vector<Item>& items);
+
+  // Deletes the segments of the spill log whose instances are all
+  // processed, acknowledged and stored by "buffer". The segments to
+  // delete are chosen at the first call, and deleted at the first call
+  // (possibly the same) where "buffer" has stored the results that
+  // were added before the choice. Returns "true" iff some segment was
+  // deleted.
+  bool Checkpoint(IWriteBehindBuffer& buffer);
+
+  size_t GetSize();
+
+  size_t GetSize(PreloadPriority priority);
+
+  uint64_t GetSpilledCount();
+
+  size_t GetSegmentsCount();
+};
@@ -0,0 +1,244 @@
+/**
+ * SPDX-FileCopyrightText: 2023 Sebastien Jodogne, UCLouvain, Belgium
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/**
+ * OHIF plugin for Orthanc
+ * Copyright (C) 2023 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+
+#include "PreloadThrottle.h"
+
+#include <OrthancException.h>
+
+#include <algorithm>
+#include <stdio.h>
+
+
+static const unsigned int UPDATE_PERIOD = 5;      // In seconds
+static const unsigned int SCHEDULE_PERIOD = 60;   // In seconds
+
+
+bool PreloadThrottle::IsBusinessHours() const
+{
+  if (!hasBusinessHours_)
+  {
+    return false;
+  }
+
+  const boost::posix_time::time_duration now = boost::posix_time::second_clock::local_time().time_of_day();
+  const unsigned int minutes = static_cast<unsigned int>(now.hours() * 60 + now.minutes());
+
+  if (businessStart_ <= businessEnd_)
+  {
+    return (businessStart_ <= minutes &&
+            minutes < businessEnd_);
+  }
+  else
+  {
+    // The business hours span midnight
+    return (minutes >= businessStart_ ||
+            minutes < businessEnd_);
+  }
+}
+
+
+void PreloadThrottle::Update()
+{
+  // The mutex must be locked
+
+  const Limits& maximum = (IsBusinessHours() ? businessMaximum_ : maximum_);
+  const unsigned int previousThreads = current_.threads_;
+
+  const boost::posix_time::ptime now = boost::posix_time::microsec_clock::universal_time();
+  
+  if ((now - lastUpdate_).total_seconds() >= static_cast<int>(UPDATE_PERIOD))
+  {
+    const bool overloaded = ((restTarget_ != 0 &&
+                              restCount_ > 0 &&
+                              restSum_ / restCount_ > restTarget_) ||
+                             (viewerTarget_ != 0 &&
+                              viewerCount_ > 0 &&
+                              viewerSum_ / viewerCount_ > viewerTarget_));
+
+    if (overloaded)
+    {
+      current_.threads_ = std::max(1u, current_.threads_ / 2);
+      current_.batchSize_ = std::max(1u, current_.batchSize_ / 2);
+    }
+    else
+    {
+      current_.threads_ += 1;
+      current_.batchSize_ += std::max(1u, maximum.batchSize_ / 10);
+    }
+
+    restSum_ = 0;
+    restCount_ = 0;
+    viewerSum_ = 0;
+    viewerCount_ = 0;
+    lastUpdate_ = now;
+  }
+
+  current_.threads_ = std::min(current_.threads_, maximum.threads_);
+  current_.batchSize_ = std::max(1u, std::min(current_.batchSize_, maximum.batchSize_));
+
+  if (current_.threads_ != previousThreads)
+  {
+    changed_.notify_all();
+  }
+}
+
+
+PreloadThrottle::PreloadThrottle() :
+  restTarget_(0),
+  viewerTarget_(0),
+  hasBusinessHours_(false),
+  businessStart_(0),
+  businessEnd_(0),
+  restSum_(0),
+  restCount_(0),
+  viewerSum_(0),
+  viewerCount_(0),
+  lastUpdate_(boost::posix_time::microsec_clock::universal_time()),
+  stopped_(false)
+{
+  maximum_.threads_ = 1;
+  maximum_.batchSize_ = 1;
+  businessMaximum_ = maximum_;
+  current_ = maximum_;
+}
+
+
+void PreloadThrottle::SetTargets(unsigned int restTarget,
+                                 unsigned int viewerTarget)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  restTarget_ = restTarget;
+  viewerTarget_ = viewerTarget;
+}
+
+
+void PreloadThrottle::SetMaximum(unsigned int threads,
+                                 unsigned int batchSize)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  maximum_.threads_ = threads;
+  maximum_.batchSize_ = std::max(1u, batchSize);
+  current_ = maximum_;
+  changed_.notify_all();
+}
+
+
+void PreloadThrottle::SetBusinessHours(const std::string& hours,
+                                       unsigned int threads,
+                                       unsigned int batchSize)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  if (hours.empty())
+  {
+    hasBusinessHours_ = false;
+    return;
+  }
+
+  unsigned int startHours, startMinutes, endHours, endMinutes;
+  if (sscanf(hours.c_str(), "%u:%u-%u:%u", &startHours, &startMinutes, &endHours, &endMinutes) != 4 ||
+      startHours > 23 ||
+      endHours > 23 ||
+      startMinutes > 59 ||
+      endMinutes > 59)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange,
+                                    "The business hours must be formatted as \"HH:MM-HH:MM\", found: " + hours);
+  }
+
+  hasBusinessHours_ = true;
+  businessStart_ = startHours * 60 + startMinutes;
+  businessEnd_ = endHours * 60 + endMinutes;
+  businessMaximum_.threads_ = threads;
+  businessMaximum_.batchSize_ = std::max(1u, batchSize);
+}
+
+
+void PreloadThrottle::AddRestLatency(uint64_t milliseconds)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  restSum_ += milliseconds;
+  restCount_++;
+}
+
+
+void PreloadThrottle::AddViewerLatency(uint64_t milliseconds)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  viewerSum_ += milliseconds;
+  viewerCount_++;
+}
+
+
+bool PreloadThrottle::WaitActive(unsigned int thread)
+{
+  boost::mutex::scoped_lock lock(mutex_);
+
+  for (;;)
+  {
+    Update();
+
+    if (stopped_)
+    {
+      return false;
+    }
+    else if (thread < current_.threads_)
+    {
+      return true;
+    }
+    else
+    {
+      // The limits only grow while other threads are running, or
+      // once the business hours are over, which is checked from
+      // time to time
+      changed_.timed_wait(lock, boost::posix_time::seconds(SCHEDULE_PERIOD));
+    }
+  }
+}
+
+
+void PreloadThrottle::Stop()
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  stopped_ = true;
+  changed_.notify_all();
+}
+
+
+unsigned int PreloadThrottle::GetBatchSize()
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  Update();
+  return current_.batchSize_;
+}
+
+
+unsigned int PreloadThrottle::GetThreadsCount()
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  Update();
+  return current_.threads_;
+}
@@ -0,0 +1,106 @@
+/**
+ * SPDX-FileCopyrightText: 2023 Sebastien Jodogne, UCLouvain, Belgium
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/**
+ * OHIF plugin for Orthanc
+ * Copyright (C) 2023 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#pragma once
+
+#include <boost/date_time/posix_time/posix_time.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <stdint.h>
+#include <string>
+
+
+/**
+ * Feedback controller that adapts the number of active preload
+ * threads and the size of their batches to the load of Orthanc. The
+ * latencies of the REST calls issued by the preload threads and of
+ * the requests of the viewer are averaged over periods of a few
+ * seconds. If one of the averages exceeds its target, the limits are
+ * halved, otherwise they are increased step by step up to their
+ * maximum. Distinct maximums can be set for the business hours, so
+ * that preloading is aggressive at night but polite during the
+ * reading hours.
+ **/
+class PreloadThrottle : public boost::noncopyable
+{
+private:
+  struct Limits
+  {
+    unsigned int  threads_;
+    unsigned int  batchSize_;
+  };
+
+  boost::mutex               mutex_;
+  boost::condition_variable  changed_;
+  unsigned int               restTarget_;    // In milliseconds, 0 means no feedback
+  unsigned int               viewerTarget_;  // In milliseconds, 0 means no feedback
+  Limits                     maximum_;
+  Limits                     businessMaximum_;
+  bool                       hasBusinessHours_;
+  unsigned int               businessStart_;  // In minutes since midnight
+  unsigned int               businessEnd_;
+  Limits                     current_;
+  uint64_t                   restSum_;
+  uint64_t                   restCount_;
+  uint64_t                   viewerSum_;
+  uint64_t                   viewerCount_;
+  boost::posix_time::ptime   lastUpdate_;
+  bool                       stopped_;
+
+  bool IsBusinessHours() const;
+
+  void Update();
+
+public:
+  PreloadThrottle();
+
+  void SetTargets(unsigned int restTarget,
+                  unsigned int viewerTarget);
+
+  void SetMaximum(unsigned int threads,
+                  unsigned int batchSize);
+
+  // The format of "hours" is "HH:MM-HH:MM" in local time. The period
+  // can span midnight. An empty string disables the business hours.
+  void SetBusinessHours(const std::string& hours,
+                        unsigned int threads,
+                        unsigned int batchSize);
+
+  void AddRestLatency(uint64_t milliseconds);
+
+  void AddViewerLatency(uint64_t milliseconds);
+
+  // Blocks the preload thread with the given index until it is
+  // allowed to run. Returns "false" iff the throttle is stopped.
+  bool WaitActive(unsigned int thread);
+
+  // Wakes up the preload threads that are blocked in "WaitActive()"
+  void Stop();
+
+  unsigned int GetBatchSize();
+
+  unsigned int GetThreadsCount();
+};
@@ -0,0 +1,339 @@
+/**
+ * SPDX-FileCopyrightText: 2023 Sebastien Jodogne, UCLouvain, Belgium
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/**
+ * OHIF plugin for Orthanc
+ * Copyright (C) 2023 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+#include "SeriesRecordsCache.h"
+
+#include <Cache/LeastRecentlyUsedIndex.h>
+#include <OrthancException.h>
+
+#include <boost/functional/hash.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <cassert>
+
+
+static size_t EstimateMemoryUsage(const Json::Value& value)
+{
+  size_t size = sizeof(Json::Value);
+  
+  switch (value.type())
+  {
+    case Json::stringValue:
+      size += value.asString().size();
+      break;
+
+    case Json::arrayValue:
+      for (Json::Value::ArrayIndex i = 0; i < value.size(); i++)
+      {
+        size += EstimateMemoryUsage(value[i]);
+      }
+      break;
+
+    case Json::objectValue:
+      for (Json::Value::const_iterator it = value.begin(); it != value.end(); ++it)
+      {
+        // Account for the key and for the node of the underlying "std::map"
+        size += it.name().size() + 4 * sizeof(void*) + EstimateMemoryUsage(*it);
+      }
+      break;
+
+    default:
+      break;
+  }
+
+  return size;
+}
+
+
+class SeriesRecordsCache::Shard : public boost::noncopyable
+{
+private:
+  struct Item
+  {
+    boost::shared_ptr<const Json::Value>  record_;
+    size_t                                memoryUsage_;
+  };
+  
+  typedef std::map<std::string, Item>                   Content;
+  typedef Orthanc::LeastRecentlyUsedIndex<std::string>  Index;
+
+  boost::mutex  mutex_;
+  Content       content_;
+  Index         index_;
+  size_t        memoryUsage_;
+  size_t        maximumMemoryUsage_;
+  uint64_t      revision_;  // Number of modifications of the shard
+  uint64_t      hits_;
+  uint64_t      misses_;
+
+  void RemoveInternal(const std::string& seriesId)
+  {
+    Content::iterator found = content_.find(seriesId);
+    if (found != content_.end())
+    {
+      assert(memoryUsage_ >= found->second.memoryUsage_);
+      memoryUsage_ -= found->second.memoryUsage_;
+      content_.erase(found);
+      index_.Invalidate(seriesId);
+    }
+  }
+
+  void MakeRoom(size_t memoryUsage)
+  {
+    while (!index_.IsEmpty() &&
+           memoryUsage_ + memoryUsage > maximumMemoryUsage_)
+    {
+      // Copy the identifier, as it is owned by the index
+      const std::string oldest = index_.GetOldest();
+      RemoveInternal(oldest);
+    }
+  }
+
+  void StoreInternal(const std::string& seriesId,
+                     const Item& item)
+  {
+    RemoveInternal(seriesId);
+
+    if (item.memoryUsage_ <= maximumMemoryUsage_)
+    {
+      MakeRoom(item.memoryUsage_);
+      content_[seriesId] = item;
+      index_.Add(seriesId);
+      memoryUsage_ += item.memoryUsage_;
+    }
+  }
+
+  static void CreateItem(Item& item,
+                         const std::string& seriesId,
+                         const Json::Value& record)
+  {
+    item.record_.reset(new Json::Value(record));
+    item.memoryUsage_ = seriesId.size() + EstimateMemoryUsage(record);
+  }
+
+public:
+  Shard() :
+    memoryUsage_(0),
+    maximumMemoryUsage_(0),
+    revision_(0),
+    hits_(0),
+    misses_(0)
+  {
+  }
+
+  void SetMaximumMemoryUsage(size_t bytes)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    maximumMemoryUsage_ = bytes;
+    MakeRoom(0);
+  }
+
+  bool Lookup(Json::Value& target,
+              uint64_t& revision,
+              const std::string& seriesId)
+  {
+    boost::shared_ptr<const Json::Value> record;
+
+    {
+      boost::mutex::scoped_lock lock(mutex_);
+
+      Content::const_iterator found = content_.find(seriesId);
+      if (found == content_.end())
+      {
+        misses_++;
+        revision = revision_;
+        return false;
+      }
+      else
+      {
+        hits_++;
+        record = found->second.record_;
+        index_.MakeMostRecent(seriesId);
+      }
+    }
+
+    // Copy the record outside of the critical section
+    assert(record.get() != NULL);
+    target = *record;
+    return true;
+  }
+
+  void StoreRead(const std::string& seriesId,
+                 const Json::Value& record,
+                 uint64_t revision)
+  {
+    Item item;
+    CreateItem(item, seriesId, record);
+
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (revision == revision_)
+    {
+      StoreInternal(seriesId, item);
+    }
+  }
+
+  void StoreWritten(const std::string& seriesId,
+                    const Json::Value& record)
+  {
+    Item item;
+    CreateItem(item, seriesId, record);
+
+    boost::mutex::scoped_lock lock(mutex_);
+    revision_++;
+    StoreInternal(seriesId, item);
+  }
+
+  void Invalidate(const std::string& seriesId)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    revision_++;
+    RemoveInternal(seriesId);
+  }
+
+  void Clear()
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    
+    revision_++;
+    content_.clear();
+    memoryUsage_ = 0;
+
+    while (!index_.IsEmpty())
+    {
+      index_.RemoveOldest();
+    }
+  }
+
+  void AddStatistics(Statistics& target)
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+    target.hits_ += hits_;
+    target.misses_ += misses_;
+    target.count_ += content_.size();
+    target.memoryUsage_ += memoryUsage_;
+    target.maximumMemoryUsage_ += maximumMemoryUsage_;
+  }
+};
+
+
+SeriesRecordsCache::Shard& SeriesRecordsCache::GetShard(const std::string& seriesId)
+{
+  assert(!shards_.empty());
+  
+  const size_t index = boost::hash<std::string>()(seriesId) % shards_.size();
+  
+  assert(shards_[index] != NULL);
+  return *shards_[index];
+}
+
+
+SeriesRecordsCache::SeriesRecordsCache(size_t countShards)
+{
+  if (countShards == 0)
+  {
+    throw Orthanc::OrthancException(Orthanc::ErrorCode_ParameterOutOfRange);
+  }
+  
+  shards_.resize(countShards);
+  
+  for (size_t i = 0; i < countShards; i++)
+  {
+    shards_[i] = new Shard;
+  }
+}
+
+
+SeriesRecordsCache::~SeriesRecordsCache()
+{
+  for (size_t i = 0; i < shards_.size(); i++)
+  {
+    assert(shards_[i] != NULL);
+    delete shards_[i];
+  }
+}
+
+
+void SeriesRecordsCache::SetMaximumMemoryUsage(size_t bytes)
+{
+  for (size_t i = 0; i < shards_.size(); i++)
+  {
+    shards_[i]->SetMaximumMemoryUsage(bytes / shards_.size());
+  }
+}
+
+
+bool SeriesRecordsCache::Lookup(Json::Value& target,
+                                uint64_t& revision,
+                                const std::string& seriesId)
+{
+  return GetShard(seriesId).Lookup(target, revision, seriesId);
+}
+
+
+void SeriesRecordsCache::StoreRead(const std::string& seriesId,
+                                   const Json::Value& record,
+                                   uint64_t revision)
+{
+  GetShard(seriesId).StoreRead(seriesId, record, revision);
+}
+
+
+void SeriesRecordsCache::StoreWritten(const std::string& seriesId,
+                                      const Json::Value& record)
+{
+  GetShard(seriesId).StoreWritten(seriesId, record);
+}
+
+
+void SeriesRecordsCache::Invalidate(const std::string& seriesId)
+{
+  GetShard(seriesId).Invalidate(seriesId);
+}
+
+
+void SeriesRecordsCache::Clear()
+{
+  for (size_t i = 0; i < shards_.size(); i++)
+  {
+    shards_[i]->Clear();
+  }
+}
+
+
+void SeriesRecordsCache::GetStatistics(Statistics& target)
+{
+  target.hits_ = 0;
+  target.misses_ = 0;
+  target.count_ = 0;
+  target.memoryUsage_ = 0;
+  target.maximumMemoryUsage_ = 0;
+  
+  for (size_t i = 0; i < shards_.size(); i++)
+  {
+    shards_[i]->AddStatistics(target);
+  }
+}
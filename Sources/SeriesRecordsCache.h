@@ -0,0 +1,96 @@
+/**
+ * SPDX-FileCopyrightText: 2023 Sebastien Jodogne, UCLouvain, Belgium
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/**
+ * OHIF plugin for Orthanc
+ * Copyright (C) 2023 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+#pragma once
+
+#include <json/value.h>
+
+#include <boost/noncopyable.hpp>
+#include <stdint.h>
+#include <vector>
+
+
+/**
+ * In-memory LRU cache of the decoded records of the series, indexed
+ * by the Orthanc identifier of the series. A record maps the Orthanc
+ * identifiers of the instances of the series to their OHIF metadata.
+ * This avoids the REST call, the base64 decoding, the gunzip, the
+ * JSON parsing and the expansion of the interned values of the "4202"
+ * metadata of the series that were recently opened. To reduce the
+ * contention between the HTTP threads of Orthanc, the cache is split
+ * into shards that are protected by distinct mutexes, and whose
+ * maximum memory usage is a fraction of the global maximum.
+ *
+ * A record read from Orthanc after a miss could be outdated by a
+ * concurrent write or invalidation. Each shard therefore counts its
+ * modifications: "Lookup()" returns the current count, and
+ * "StoreRead()" ignores the record if the shard was modified since.
+ **/
+class SeriesRecordsCache : public boost::noncopyable
+{
+private:
+  class Shard;
+
+  std::vector<Shard*>  shards_;
+
+  Shard& GetShard(const std::string& seriesId);
+
+public:
+  struct Statistics
+  {
+    uint64_t  hits_;
+    uint64_t  misses_;
+    size_t    count_;
+    size_t    memoryUsage_;
+    size_t    maximumMemoryUsage_;
+  };
+
+  explicit SeriesRecordsCache(size_t countShards);
+
+  ~SeriesRecordsCache();
+
+  // Setting the maximum memory usage to zero disables the cache
+  void SetMaximumMemoryUsage(size_t bytes);
+
+  // On a miss, "revision" is set to the value to be provided to
+  // "StoreRead()"
+  bool Lookup(Json::Value& target,
+              uint64_t& revision,
+              const std::string& seriesId);
+
+  // Stores a record that was read from Orthanc after a miss
+  void StoreRead(const std::string& seriesId,
+                 const Json::Value& record,
+                 uint64_t revision);
+
+  // Stores a record that was just written to Orthanc
+  void StoreWritten(const std::string& seriesId,
+                    const Json::Value& record);
+
+  void Invalidate(const std::string& seriesId);
+
+  void Clear();
+
+  void GetStatistics(Statistics& target);
+};
@@ -0,0 +1,229 @@
+/**
+ * SPDX-FileCopyrightText: 2023 Sebastien Jodogne, UCLouvain, Belgium
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/**
+ * OHIF plugin for Orthanc
+ * Copyright (C) 2023 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+
+#include "SeriesVolume.h"
+
+#include <DicomFormat/DicomTag.h>
+
+#include <algorithm>
+#include <cmath>
+
+
+static const double  MIN_SLICE_SPACING = 0.001;  // In millimeters
+static const double  SPACING_TOLERANCE = 0.01;   // Relative to the average spacing
+
+
+namespace
+{
+  class SlicesOrder
+  {
+  private:
+    const std::vector<const SeriesVolume::Slice*>&  slices_;
+    bool                                            geometric_;
+
+  public:
+    SlicesOrder(const std::vector<const SeriesVolume::Slice*>& slices,
+                bool geometric) :
+      slices_(slices),
+      geometric_(geometric)
+    {
+    }
+
+    bool operator() (size_t a,
+                     size_t b) const
+    {
+      const SeriesVolume::Slice& x = *slices_[a];
+      const SeriesVolume::Slice& y = *slices_[b];
+
+      if (geometric_ &&
+          x.distance_ != y.distance_)
+      {
+        return x.distance_ > y.distance_;
+      }
+      else if (x.hasInstanceNumber_ != y.hasInstanceNumber_)
+      {
+        return x.hasInstanceNumber_;  // The instances without a number come last
+      }
+      else if (x.hasInstanceNumber_ &&
+               x.instanceNumber_ != y.instanceNumber_)
+      {
+        return x.instanceNumber_ < y.instanceNumber_;
+      }
+      else
+      {
+        return x.instanceId_ < y.instanceId_;
+      }
+    }
+  };
+}
+
+
+static bool ReadVector(double* target,
+                       size_t size,
+                       const Json::Value& instanceTags,
+                       const std::string& key)
+{
+  if (!instanceTags.isMember(key))
+  {
+    return false;
+  }
+
+  const Json::Value& value = instanceTags[key];
+  if (value.type() != Json::arrayValue ||
+      value.size() != size)
+  {
+    return false;
+  }
+
+  for (Json::ArrayIndex i = 0; i < value.size(); i++)
+  {
+    if (!value[i].isNumeric())
+    {
+      return false;
+    }
+
+    target[i] = value[i].asDouble();
+  }
+
+  return true;
+}
+
+
+SeriesVolume::Slice::Slice() :
+  orientation_(NULL),
+  rows_(NULL),
+  columns_(NULL),
+  hasDistance_(false),
+  distance_(0),
+  hasInstanceNumber_(false),
+  instanceNumber_(0)
+{
+}
+
+
+void SeriesVolume::Slice::ReadGeometry(const Json::Value& instanceTags)
+{
+  static const std::string IMAGE_POSITION_PATIENT = Orthanc::DICOM_TAG_IMAGE_POSITION_PATIENT.Format();
+  static const std::string IMAGE_ORIENTATION_PATIENT = Orthanc::DICOM_TAG_IMAGE_ORIENTATION_PATIENT.Format();
+  static const std::string INSTANCE_NUMBER = Orthanc::DICOM_TAG_INSTANCE_NUMBER.Format();
+
+  double position[3], orientation[6];
+  if (ReadVector(position, 3, instanceTags, IMAGE_POSITION_PATIENT) &&
+      ReadVector(orientation, 6, instanceTags, IMAGE_ORIENTATION_PATIENT))
+  {
+    // The normal is the cross product of the row and column vectors
+    const double normal[3] = {
+      orientation[1] * orientation[5] - orientation[2] * orientation[4],
+      orientation[2] * orientation[3] - orientation[0] * orientation[5],
+      orientation[0] * orientation[4] - orientation[1] * orientation[3]
+    };
+
+    hasDistance_ = true;
+    distance_ = position[0] * normal[0] + position[1] * normal[1] + position[2] * normal[2];
+  }
+
+  if (instanceTags.isMember(INSTANCE_NUMBER) &&
+      instanceTags[INSTANCE_NUMBER].isInt())
+  {
+    hasInstanceNumber_ = true;
+    instanceNumber_ = instanceTags[INSTANCE_NUMBER].asInt();
+  }
+}
+
+
+SeriesVolume::SeriesVolume() :
+  geometric_(false),
+  reconstructable_(false),
+  uniform_(false),
+  spacing_(0)
+{
+}
+
+
+void SeriesVolume::Analyze(std::vector<size_t>& order,
+                           const std::vector<const Slice*>& slices)
+{
+  geometric_ = !slices.empty();
+  reconstructable_ = false;
+  uniform_ = false;
+  spacing_ = 0;
+
+  for (size_t i = 0; i < slices.size(); i++)
+  {
+    if (!slices[i]->hasDistance_ ||
+        slices[i]->orientation_ != slices[0]->orientation_)
+    {
+      geometric_ = false;
+    }
+  }
+
+  order.resize(slices.size());
+  for (size_t i = 0; i < order.size(); i++)
+  {
+    order[i] = i;
+  }
+
+  std::sort(order.begin(), order.end(), SlicesOrder(slices, geometric_));
+
+  if (geometric_ &&
+      order.size() >= 2)
+  {
+    const Slice& first = *slices[order.front()];
+    const Slice& last = *slices[order.back()];
+
+    spacing_ = (first.distance_ - last.distance_) / static_cast<double>(order.size() - 1);
+
+    bool sameSize = (first.rows_ != NULL &&
+                     first.columns_ != NULL);
+    bool distinct = true;
+    bool uniform = true;
+
+    for (size_t i = 1; i < order.size(); i++)
+    {
+      const Slice& previous = *slices[order[i - 1]];
+      const Slice& current = *slices[order[i]];
+
+      if (current.rows_ != first.rows_ ||
+          current.columns_ != first.columns_)
+      {
+        sameSize = false;
+      }
+
+      const double spacing = previous.distance_ - current.distance_;
+      if (spacing < MIN_SLICE_SPACING)
+      {
+        distinct = false;  // Overlapping slices, e.g. multiple echoes
+      }
+      else if (fabs(spacing - spacing_) > SPACING_TOLERANCE * spacing_)
+      {
+        uniform = false;
+      }
+    }
+
+    reconstructable_ = (sameSize && distinct);
+    uniform_ = (distinct && uniform);
+  }
+}
@@ -0,0 +1,101 @@
+/**
+ * SPDX-FileCopyrightText: 2023 Sebastien Jodogne, UCLouvain, Belgium
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/**
+ * OHIF plugin for Orthanc
+ * Copyright (C) 2023 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+
+#pragma once
+
+#include <json/value.h>
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+
+/**
+ * Geometric analysis of the instances of one series. If all the
+ * instances have a position and the same orientation, they are
+ * sorted by decreasing position along the normal of the slices,
+ * which is the order of the volumes of Cornerstone. Otherwise, they
+ * are sorted by instance number. The analysis also tells whether the
+ * sorted slices form a volume, and whether their spacing is regular.
+ **/
+class SeriesVolume
+{
+public:
+  struct Slice
+  {
+    std::string  instanceId_;  // Orthanc ID, breaks the ties
+
+    // As the members of the instances are interned, two instances
+    // have the same orientation (resp. size) iff they point to the
+    // same string
+    const std::string*  orientation_;
+    const std::string*  rows_;
+    const std::string*  columns_;
+    bool                hasDistance_;
+    double              distance_;  // Position projected onto the normal of the slice
+    bool                hasInstanceNumber_;
+    int32_t             instanceNumber_;
+
+    Slice();
+
+    // Reads the position, the orientation and the number of the
+    // instance, as encoded by "ParseTagFromOrthanc()"
+    void ReadGeometry(const Json::Value& instanceTags);
+  };
+
+private:
+  bool    geometric_;        // Whether the slices are sorted by position
+  bool    reconstructable_;
+  bool    uniform_;
+  double  spacing_;          // Average spacing between the slices
+
+public:
+  SeriesVolume();
+
+  // "order" receives the indices in "slices", in the order of the volume
+  void Analyze(std::vector<size_t>& order,
+               const std::vector<const Slice*>& slices);
+
+  bool IsGeometric() const
+  {
+    return geometric_;
+  }
+
+  bool IsReconstructable() const
+  {
+    return reconstructable_;
+  }
+
+  bool IsUniform() const
+  {
+    return uniform_;
+  }
+
+  double GetSliceSpacing() const
+  {
+    return spacing_;
+  }
+};
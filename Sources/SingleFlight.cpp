@@ -0,0 +1,150 @@
+/**
+ * SPDX-FileCopyrightText: 2023 Sebastien Jodogne, UCLouvain, Belgium
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/**
+ * OHIF plugin for Orthanc
+ * Copyright (C) 2023 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+
+#include "SingleFlight.h"
+
+#include <memory>
+
+
+struct SingleFlight::Flight
+{
+  bool                                        done_;
+  boost::shared_ptr<const std::string>        value_;
+  std::unique_ptr<Orthanc::OrthancException>  error_;
+
+  Flight() :
+    done_(false)
+  {
+  }
+};
+
+
+Orthanc::OrthancException* SingleFlight::Execute(std::string& value,
+                                                 IComputation& computation)
+{
+  // The mutex must NOT be locked
+
+  try
+  {
+    computation.Compute(value);
+    return NULL;
+  }
+  catch (Orthanc::OrthancException& e)
+  {
+    return new Orthanc::OrthancException(e);
+  }
+  catch (std::exception& e)
+  {
+    return new Orthanc::OrthancException(Orthanc::ErrorCode_InternalError, e.what());
+  }
+  catch (...)
+  {
+    return new Orthanc::OrthancException(Orthanc::ErrorCode_InternalError);
+  }
+}
+
+
+SingleFlight::SingleFlight() :
+  shared_(0)
+{
+}
+
+
+boost::shared_ptr<const std::string> SingleFlight::Run(const std::string& key,
+                                                       IComputation& computation)
+{
+  boost::shared_ptr<Flight> flight;
+
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    Flights::const_iterator found = flights_.find(key);
+    if (found != flights_.end())
+    {
+      // Another caller is computing the same value
+      flight = found->second;
+      shared_++;
+
+      while (!flight->done_)
+      {
+        landed_.wait(lock);
+      }
+
+      if (flight->error_.get() != NULL)
+      {
+        throw Orthanc::OrthancException(*flight->error_);
+      }
+      else
+      {
+        return flight->value_;
+      }
+    }
+
+    flight.reset(new Flight);
+    flights_[key] = flight;
+  }
+
+  std::unique_ptr<std::string> value(new std::string);
+  std::unique_ptr<Orthanc::OrthancException> error(Execute(*value, computation));
+
+  boost::shared_ptr<const std::string> result;
+  if (error.get() == NULL)
+  {
+    result.reset(value.release());
+  }
+
+  {
+    boost::mutex::scoped_lock lock(mutex_);
+
+    flights_.erase(key);
+
+    flight->done_ = true;
+    flight->value_ = result;
+
+    if (error.get() != NULL)
+    {
+      flight->error_.reset(new Orthanc::OrthancException(*error));
+    }
+
+    landed_.notify_all();
+  }
+
+  if (error.get() != NULL)
+  {
+    throw Orthanc::OrthancException(*error);
+  }
+  else
+  {
+    return result;
+  }
+}
+
+
+uint64_t SingleFlight::GetSharedCount()
+{
+  boost::mutex::scoped_lock lock(mutex_);
+  return shared_;
+}
@@ -0,0 +1,82 @@
+/**
+ * SPDX-FileCopyrightText: 2023 Sebastien Jodogne, UCLouvain, Belgium
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/**
+ * OHIF plugin for Orthanc
+ * Copyright (C) 2023 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+
+#pragma once
+
+#include <OrthancException.h>
+
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <map>
+#include <stdint.h>
+#include <string>
+
+
+/**
+ * De-duplication of the concurrent computations of the same value.
+ * The first caller for some key runs the computation, while the
+ * callers that arrive with the same key before it is over wait for
+ * it, and share its result (or its error). The key is forgotten as
+ * soon as the computation is over, so this is not a cache.
+ **/
+class SingleFlight : public boost::noncopyable
+{
+public:
+  class IComputation : public boost::noncopyable
+  {
+  public:
+    virtual ~IComputation()
+    {
+    }
+
+    virtual void Compute(std::string& value) = 0;
+  };
+
+private:
+  struct Flight;
+
+  typedef std::map<std::string, boost::shared_ptr<Flight> >  Flights;
+
+  boost::mutex               mutex_;
+  boost::condition_variable  landed_;
+  Flights                    flights_;
+  uint64_t                   shared_;
+
+  // Returns the error raised by the computation, if any
+  static Orthanc::OrthancException* Execute(std::string& value,
+                                            IComputation& computation);
+
+public:
+  SingleFlight();
+
+  boost::shared_ptr<const std::string> Run(const std::string& key,
+                                           IComputation& computation);
+
+  // Number of callers that have shared the computation of another one
+  uint64_t GetSharedCount();
+};
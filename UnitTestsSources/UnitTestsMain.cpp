@@ -0,0 +1,764 @@
+/**
+ * SPDX-FileCopyrightText: 2023 Sebastien Jodogne, UCLouvain, Belgium
+ * SPDX-License-Identifier: GPL-3.0-or-later
+ */
+
+/**
+ * OHIF plugin for Orthanc
+ * Copyright (C) 2023 Sebastien Jodogne, UCLouvain, Belgium
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ **/
+
+
+
+
+#include "../Sources/JsonStreamWriter.h"
+#include "../Sources/PreloadQueue.h"
+#include "../Sources/SeriesRecordsCache.h"
+#include "../Sources/SeriesVolume.h"
+
+#include <DicomFormat/DicomTag.h>
+#include <OrthancException.h>
+
+#include <gtest/gtest.h>
+#include <json/reader.h>
+#include <boost/lexical_cast.hpp>
+#include <cstdio>
+#include <fstream>
+#include <list>
+#include <stdint.h>
+
+
+static const char* const  SPILL_LOG = "UnitTestsPreloadQueue.log";
+static const unsigned int MAX_SEGMENTS = 100;
+
+
+class WriteBehindBuffer : public PreloadQueue::IWriteBehindBuffer
+{
+private:
+  uint64_t  added_;
+  uint64_t  stored_;
+
+public:
+  WriteBehindBuffer() :
+    added_(0),
+    stored_(0)
+  {
+  }
+
+  void Add()
+  {
+    added_++;
+  }
+
+  void Store()
+  {
+    stored_ = added_;
+  }
+
+  virtual uint64_t GetAddedMark()
+  {
+    return added_;
+  }
+
+  virtual bool IsStored(uint64_t mark)
+  {
+    return mark <= stored_;
+  }
+};
+
+
+static std::string GetSegmentPath(unsigned int number)
+{
+  return std::string(SPILL_LOG) + "." + boost::lexical_cast<std::string>(number);
+}
+
+
+static void RemoveSpillLog()
+{
+  for (unsigned int i = 0; i < MAX_SEGMENTS; i++)
+  {
+    remove(GetSegmentPath(i).c_str());
+  }
+}
+
+
+// Reads the identifiers of all the segments of the spill log
+static void ReadSpillLog(std::vector<std::string>& target)
+{
+  target.clear();
+
+  for (unsigned int i = 0; i < MAX_SEGMENTS; i++)
+  {
+    std::ifstream reader(GetSegmentPath(i).c_str());
+    std::string line;
+    while (std::getline(reader, line))
+    {
+      if (!line.empty())
+      {
+        target.push_back(line);
+      }
+    }
+  }
+}
+
+
+static bool HasSegment(unsigned int number)
+{
+  std::ifstream reader(GetSegmentPath(number).c_str());
+  return reader.is_open();
+}
+
+
+// Dequeues and acknowledges all the items, in their order of priority
+static void Drain(std::vector<std::string>& target,
+                  PreloadQueue& queue)
+{
+  target.clear();
+
+  std::vector<PreloadQueue::Item> items;
+  while (queue.DequeueBatch(items, 100, 10))
+  {
+    for (size_t i = 0; i < items.size(); i++)
+    {
+      if (items[i].GetLevel() == Orthanc::ResourceType_Instance)
+      {
+        target.push_back(items[i].GetId());
+      }
+      else
+      {
+        target.insert(target.end(), items[i].GetInstances().begin(), items[i].GetInstances().end());
+      }
+    }
+
+    queue.Acknowledge(items);
+  }
+}
+
+
+TEST(PreloadQueue, InMemory)
+{
+  PreloadQueue queue(2);
+  queue.Open("");
+
+  ASSERT_TRUE(queue.Enqueue("a"));
+  ASSERT_TRUE(queue.Enqueue("a"));  // Already queued
+  ASSERT_TRUE(queue.Enqueue("b"));
+  ASSERT_FALSE(queue.Enqueue("c"));  // Dropped, as there is no spill log
+  ASSERT_EQ(2u, queue.GetSize());
+  ASSERT_EQ(0u, queue.GetSpilledCount());
+
+  std::vector<std::string> ids;
+  Drain(ids, queue);
+  ASSERT_EQ(2u, ids.size());
+  ASSERT_EQ("a", ids[0]);
+  ASSERT_EQ("b", ids[1]);
+}
+
+
+TEST(PreloadQueue, SpillInOrder)
+{
+  RemoveSpillLog();
+
+  PreloadQueue queue(2);
+  queue.SetSegmentSize(2);
+  queue.Open(SPILL_LOG);
+
+  for (unsigned int i = 0; i < 5; i++)
+  {
+    ASSERT_TRUE(queue.Enqueue("i" + boost::lexical_cast<std::string>(i)));
+  }
+
+  ASSERT_EQ(2u, queue.GetSize());
+  ASSERT_EQ(3u, queue.GetSpilledCount());
+  ASSERT_EQ(3u, queue.GetSegmentsCount());
+
+  std::vector<std::string> lines;
+  ReadSpillLog(lines);
+  ASSERT_EQ(5u, lines.size());
+
+  // The spilled instances are read across the segments
+  std::vector<std::string> ids;
+  Drain(ids, queue);
+  ASSERT_EQ(5u, ids.size());
+  for (unsigned int i = 0; i < 5; i++)
+  {
+    ASSERT_EQ("i" + boost::lexical_cast<std::string>(i), ids[i]);
+  }
+
+  ASSERT_EQ(0u, queue.GetSpilledCount());
+  queue.Close();
+  RemoveSpillLog();
+}
+
+
+TEST(PreloadQueue, CheckpointWhileBusy)
+{
+  RemoveSpillLog();
+
+  PreloadQueue queue(10);
+  queue.SetSegmentSize(2);
+  queue.Open(SPILL_LOG);
+
+  WriteBehindBuffer buffer;
+  ASSERT_FALSE(queue.Checkpoint(buffer));  // Nothing to delete
+
+  queue.Enqueue("a");
+  queue.Enqueue("b");
+  queue.Enqueue("c");  // Starts the second segment
+
+  std::vector<PreloadQueue::Item> items;
+  ASSERT_TRUE(queue.DequeueBatch(items, 2, 10));
+  ASSERT_EQ(2u, items.size());
+  ASSERT_FALSE(queue.Checkpoint(buffer));  // The items are not acknowledged
+
+  buffer.Add();
+  buffer.Add();
+  queue.Acknowledge(items);
+
+  // The queue is never idle
+  queue.Enqueue("d");
+  queue.Enqueue("e");  // Starts the third segment
+  ASSERT_EQ(3u, queue.GetSegmentsCount());
+
+  ASSERT_FALSE(queue.Checkpoint(buffer));  // The results are not stored
+
+  // If Orthanc crashes at this point, all the instances are replayed
+  std::vector<std::string> lines;
+  ReadSpillLog(lines);
+  ASSERT_EQ(5u, lines.size());
+
+  buffer.Store();
+  ASSERT_TRUE(queue.Checkpoint(buffer));
+  ASSERT_EQ(2u, queue.GetSegmentsCount());
+  ASSERT_FALSE(HasSegment(0));
+
+  ReadSpillLog(lines);
+  ASSERT_EQ(3u, lines.size());
+  ASSERT_EQ("c", lines[0]);
+
+  // The instances that are still queued protect their segments
+  ASSERT_FALSE(queue.Checkpoint(buffer));
+  ASSERT_EQ(2u, queue.GetSegmentsCount());
+
+  queue.Close();
+  RemoveSpillLog();
+}
+
+
+TEST(PreloadQueue, CheckpointWhenIdle)
+{
+  RemoveSpillLog();
+
+  PreloadQueue queue(2);
+  queue.Open(SPILL_LOG);
+
+  queue.Enqueue("a");
+  queue.Enqueue("b");
+  queue.Enqueue("c");
+
+  std::vector<PreloadQueue::Item> items;
+  ASSERT_TRUE(queue.DequeueBatch(items, 100, 10));
+  ASSERT_EQ(2u, items.size());
+  queue.Acknowledge(items);
+
+  WriteBehindBuffer buffer;
+  ASSERT_FALSE(queue.Checkpoint(buffer));  // Unread instance in the spill log
+
+  ASSERT_TRUE(queue.DequeueBatch(items, 100, 10));
+  ASSERT_EQ(1u, items.size());
+  ASSERT_EQ("c", items[0].GetId());
+  buffer.Add();
+  queue.Acknowledge(items);
+
+  ASSERT_FALSE(queue.Checkpoint(buffer));  // The results are not stored
+  ASSERT_EQ(2u, queue.GetSegmentsCount());
+
+  buffer.Store();
+  ASSERT_TRUE(queue.Checkpoint(buffer));
+
+  std::vector<std::string> lines;
+  ReadSpillLog(lines);
+  ASSERT_TRUE(lines.empty());
+  ASSERT_EQ(1u, queue.GetSegmentsCount());
+
+  // The spill log is still used after a checkpoint
+  queue.Enqueue("d");
+  ReadSpillLog(lines);
+  ASSERT_EQ(1u, lines.size());
+  ASSERT_EQ("d", lines[0]);
+
+  queue.Close();
+  RemoveSpillLog();
+}
+
+
+TEST(PreloadQueue, Uncoalesce)
+{
+  RemoveSpillLog();
+
+  PreloadQueue queue(10);
+  queue.Open(SPILL_LOG);
+  queue.Enqueue("a");
+  queue.Enqueue("b");
+  queue.Enqueue("c");
+
+  std::list<std::string> coalesced;
+  coalesced.push_back("a");
+  coalesced.push_back("b");
+  ASSERT_TRUE(queue.Coalesce("study", coalesced, 2));
+
+  std::vector<PreloadQueue::Item> items;
+  ASSERT_TRUE(queue.DequeueBatch(items, 2, 0));
+  ASSERT_EQ(2u, items.size());
+  ASSERT_EQ("c", items[0].GetId());
+  ASSERT_EQ(Orthanc::ResourceType_Study, items[1].GetLevel());
+
+  // The study has failed: Its instances are put back individually
+  queue.Uncoalesce(items[1]);
+  queue.Acknowledge(items);
+  ASSERT_EQ(2u, queue.GetSize());
+  ASSERT_EQ(2u, queue.GetSize(PreloadPriority_Low));
+
+  // The segment is kept until the instances are processed
+  WriteBehindBuffer buffer;
+  ASSERT_FALSE(queue.Checkpoint(buffer));
+
+  std::vector<std::string> ids;
+  Drain(ids, queue);
+  ASSERT_EQ(2u, ids.size());
+  ASSERT_EQ("a", ids[0]);
+  ASSERT_EQ("b", ids[1]);
+
+  ASSERT_TRUE(queue.Checkpoint(buffer));
+  ASSERT_FALSE(HasSegment(0));
+
+  queue.Close();
+  RemoveSpillLog();
+}
+
+
+TEST(PreloadQueue, StopDuringStudy)
+{
+  RemoveSpillLog();
+
+  {
+    PreloadQueue queue(10);
+    queue.Open(SPILL_LOG);
+    queue.Enqueue("a");
+    queue.Enqueue("b");
+    queue.Enqueue("c");
+
+    std::list<std::string> coalesced;
+    coalesced.push_back("b");
+    coalesced.push_back("c");
+    ASSERT_TRUE(queue.Coalesce("study", coalesced, 2));
+
+    std::vector<PreloadQueue::Item> items;
+    ASSERT_TRUE(queue.DequeueBatch(items, 2, 0));
+    ASSERT_EQ(2u, items.size());
+    ASSERT_EQ(Orthanc::ResourceType_Study, items[1].GetLevel());
+
+    // Orthanc stops while the study is processed: The study is put
+    // back, and the whole batch is acknowledged
+    queue.Stop();
+    queue.Requeue(items[1]);
+    queue.Acknowledge(items);
+
+    WriteBehindBuffer buffer;
+    ASSERT_FALSE(queue.Checkpoint(buffer));
+
+    queue.Close();
+  }
+
+  // The instances of the study survive the shutdown
+  std::vector<std::string> lines;
+  ReadSpillLog(lines);
+  ASSERT_EQ(2u, lines.size());
+  ASSERT_EQ("b", lines[0]);
+  ASSERT_EQ("c", lines[1]);
+
+  RemoveSpillLog();
+}
+
+
+TEST(PreloadQueue, Replay)
+{
+  RemoveSpillLog();
+
+  {
+    PreloadQueue queue(10);
+    queue.Open(SPILL_LOG);
+    queue.Enqueue("a");
+    queue.Enqueue("b");
+    queue.Enqueue("c");
+
+    std::list<std::string> coalesced;
+    coalesced.push_back("a");
+    coalesced.push_back("b");
+    ASSERT_TRUE(queue.Coalesce("study", coalesced, 2));
+    ASSERT_EQ(2u, queue.GetSize());
+
+    // The coalesced instances are saved individually
+    queue.Close();
+  }
+
+  std::vector<std::string> lines;
+  ReadSpillLog(lines);
+  ASSERT_EQ(3u, lines.size());
+  ASSERT_FALSE(HasSegment(0));
+  ASSERT_TRUE(HasSegment(1));
+
+  {
+    // Simulate a crash while writing a line
+    std::ofstream writer(GetSegmentPath(1).c_str(), std::ofstream::out | std::ofstream::binary | std::ofstream::app);
+    writer << "partial";
+  }
+
+  {
+    PreloadQueue queue(10);
+    queue.Open(SPILL_LOG);
+    queue.Enqueue("d");
+
+    // The replayed instances have a low priority
+    std::vector<std::string> ids;
+    Drain(ids, queue);
+    ASSERT_EQ(5u, ids.size());
+    ASSERT_EQ("d", ids[0]);
+    ASSERT_EQ("c", ids[1]);
+    ASSERT_EQ("a", ids[2]);
+    ASSERT_EQ("b", ids[3]);
+    ASSERT_EQ("partial", ids[4]);
+  }
+
+  RemoveSpillLog();
+}
+
+
+static void CreateSeriesRecord(Json::Value& target,
+                               const std::string& instanceId)
+{
+  target = Json::objectValue;
+  target[instanceId] = Json::objectValue;
+  target[instanceId]["0008,0060"] = "CT";
+}
+
+
+TEST(SeriesRecordsCache, Basic)
+{
+  SeriesRecordsCache cache(1);
+  cache.SetMaximumMemoryUsage(1024 * 1024);
+
+  Json::Value record, found;
+  uint64_t revision;
+  ASSERT_FALSE(cache.Lookup(found, revision, "series"));
+
+  CreateSeriesRecord(record, "a");
+  cache.StoreRead("series", record, revision);
+  ASSERT_TRUE(cache.Lookup(found, revision, "series"));
+  ASSERT_EQ(record, found);
+
+  cache.Invalidate("series");
+  ASSERT_FALSE(cache.Lookup(found, revision, "series"));
+
+  SeriesRecordsCache::Statistics statistics;
+  cache.GetStatistics(statistics);
+  ASSERT_EQ(1u, statistics.hits_);
+  ASSERT_EQ(2u, statistics.misses_);
+  ASSERT_EQ(0u, statistics.count_);
+  ASSERT_EQ(0u, statistics.memoryUsage_);
+}
+
+
+TEST(SeriesRecordsCache, Revision)
+{
+  SeriesRecordsCache cache(1);
+  cache.SetMaximumMemoryUsage(1024 * 1024);
+
+  Json::Value stale, written, found;
+  CreateSeriesRecord(stale, "a");
+  CreateSeriesRecord(written, "b");
+
+  // A record that is read before a concurrent write is not cached
+  uint64_t revision;
+  ASSERT_FALSE(cache.Lookup(found, revision, "series"));
+  cache.StoreWritten("series", written);
+  cache.StoreRead("series", stale, revision);
+  ASSERT_TRUE(cache.Lookup(found, revision, "series"));
+  ASSERT_EQ(written, found);
+
+  // Same for a concurrent invalidation
+  cache.Invalidate("series");
+  ASSERT_FALSE(cache.Lookup(found, revision, "series"));
+  cache.Invalidate("series");
+  cache.StoreRead("series", stale, revision);
+  ASSERT_FALSE(cache.Lookup(found, revision, "series"));
+}
+
+
+TEST(SeriesRecordsCache, Eviction)
+{
+  SeriesRecordsCache cache(1);
+
+  Json::Value record, found;
+  CreateSeriesRecord(record, "a");
+  uint64_t revision;
+
+  // The cache is disabled by default
+  cache.StoreWritten("s1", record);
+  ASSERT_FALSE(cache.Lookup(found, revision, "s1"));
+
+  cache.StoreWritten("s1", record);
+  cache.SetMaximumMemoryUsage(1024 * 1024);
+  cache.StoreWritten("s1", record);
+
+  SeriesRecordsCache::Statistics statistics;
+  cache.GetStatistics(statistics);
+  ASSERT_EQ(1u, statistics.count_);
+
+  // Room for two records: The least recently used one is evicted
+  cache.SetMaximumMemoryUsage(statistics.memoryUsage_ * 2);
+  cache.StoreWritten("s2", record);
+  ASSERT_TRUE(cache.Lookup(found, revision, "s1"));
+  cache.StoreWritten("s3", record);
+
+  ASSERT_TRUE(cache.Lookup(found, revision, "s1"));
+  ASSERT_FALSE(cache.Lookup(found, revision, "s2"));
+  ASSERT_TRUE(cache.Lookup(found, revision, "s3"));
+
+  cache.Clear();
+  ASSERT_FALSE(cache.Lookup(found, revision, "s1"));
+}
+
+
+TEST(JsonStreamWriter, Escape)
+{
+  const std::string s = "a\"b\\c/\b\f\n\r\t\x01\x1f" "d\xc3\xa9";
+
+  std::string json;
+  JsonStreamWriter writer(json);
+  writer.String(s);
+  ASSERT_EQ("\"a\\\"b\\\\c/\\b\\f\\n\\r\\t\\u0001\\u001f" "d\xc3\xa9\"", json);
+
+  Json::Value parsed;
+  Json::Reader reader;
+  ASSERT_TRUE(reader.parse(json, parsed));
+  ASSERT_EQ(Json::stringValue, parsed.type());
+  ASSERT_EQ(s, parsed.asString());
+}
+
+
+TEST(JsonStreamWriter, Nesting)
+{
+  std::string member;
+  JsonStreamWriter::FormatMember(member, "k\"ey", "value");
+  ASSERT_EQ("\"k\\\"ey\":\"value\"", member);
+
+  std::string json;
+  JsonStreamWriter writer(json);
+  writer.StartObject();
+  writer.Key("a");
+  writer.StartArray();
+  writer.Raw("1");
+  writer.String("x");
+  writer.StartObject();
+  writer.EndObject();
+  writer.EndArray();
+  writer.RawMember(member);
+  writer.Key("b");
+  writer.StartArray();
+  writer.EndArray();
+  ASSERT_FALSE(writer.IsComplete());
+  writer.EndObject();
+  ASSERT_TRUE(writer.IsComplete());
+
+  ASSERT_EQ("{\"a\":[1,\"x\",{}],\"k\\\"ey\":\"value\",\"b\":[]}", json);
+
+  ASSERT_THROW(writer.EndObject(), Orthanc::OrthancException);
+  ASSERT_THROW(writer.Key("c"), Orthanc::OrthancException);
+}
+
+
+static void AddSlice(std::vector<SeriesVolume::Slice>& slices,
+                     const std::string& instanceId,
+                     const std::string* orientation,
+                     double distance)
+{
+  slices.push_back(SeriesVolume::Slice());
+  slices.back().instanceId_ = instanceId;
+  slices.back().orientation_ = orientation;
+  slices.back().hasDistance_ = true;
+  slices.back().distance_ = distance;
+}
+
+
+static void Analyze(std::vector<size_t>& order,
+                    SeriesVolume& volume,
+                    const std::vector<SeriesVolume::Slice>& slices)
+{
+  std::vector<const SeriesVolume::Slice*> pointers(slices.size());
+  for (size_t i = 0; i < slices.size(); i++)
+  {
+    pointers[i] = &slices[i];
+  }
+
+  volume.Analyze(order, pointers);
+}
+
+
+TEST(SeriesVolume, ReadGeometry)
+{
+  Json::Value tags = Json::objectValue;
+  tags[Orthanc::DICOM_TAG_INSTANCE_NUMBER.Format()] = 7;
+  tags[Orthanc::DICOM_TAG_IMAGE_POSITION_PATIENT.Format()] = Json::arrayValue;
+  tags[Orthanc::DICOM_TAG_IMAGE_POSITION_PATIENT.Format()].append(10);
+  tags[Orthanc::DICOM_TAG_IMAGE_POSITION_PATIENT.Format()].append(20);
+  tags[Orthanc::DICOM_TAG_IMAGE_POSITION_PATIENT.Format()].append(-30.5);
+
+  SeriesVolume::Slice slice;
+  slice.ReadGeometry(tags);
+  ASSERT_FALSE(slice.hasDistance_);  // No orientation
+  ASSERT_TRUE(slice.hasInstanceNumber_);
+  ASSERT_EQ(7, slice.instanceNumber_);
+
+  // Axial slice, whose normal is the Z axis
+  Json::Value& orientation = tags[Orthanc::DICOM_TAG_IMAGE_ORIENTATION_PATIENT.Format()];
+  orientation = Json::arrayValue;
+  orientation.append(1);
+  orientation.append(0);
+  orientation.append(0);
+  orientation.append(0);
+  orientation.append(1);
+  orientation.append(0);
+
+  slice.ReadGeometry(tags);
+  ASSERT_TRUE(slice.hasDistance_);
+  ASSERT_DOUBLE_EQ(-30.5, slice.distance_);
+
+  SeriesVolume::Slice empty;
+  empty.ReadGeometry(Json::objectValue);
+  ASSERT_FALSE(empty.hasDistance_);
+  ASSERT_FALSE(empty.hasInstanceNumber_);
+}
+
+
+TEST(SeriesVolume, Uniform)
+{
+  const std::string orientation = "axial";
+  const std::string rows = "512";
+  const std::string columns = "256";
+
+  std::vector<SeriesVolume::Slice> slices;
+  AddSlice(slices, "a", &orientation, 0);
+  AddSlice(slices, "b", &orientation, 2.5);
+  AddSlice(slices, "c", &orientation, 1.25);
+
+  for (size_t i = 0; i < slices.size(); i++)
+  {
+    slices[i].rows_ = &rows;
+    slices[i].columns_ = &columns;
+  }
+
+  std::vector<size_t> order;
+  SeriesVolume volume;
+  Analyze(order, volume, slices);
+
+  ASSERT_EQ(3u, order.size());
+  ASSERT_EQ(1u, order[0]);  // By decreasing position
+  ASSERT_EQ(2u, order[1]);
+  ASSERT_EQ(0u, order[2]);
+
+  ASSERT_TRUE(volume.IsGeometric());
+  ASSERT_TRUE(volume.IsUniform());
+  ASSERT_TRUE(volume.IsReconstructable());
+  ASSERT_DOUBLE_EQ(1.25, volume.GetSliceSpacing());
+
+  // The size of the images is unknown
+  slices[0].rows_ = NULL;
+  Analyze(order, volume, slices);
+  ASSERT_TRUE(volume.IsUniform());
+  ASSERT_FALSE(volume.IsReconstructable());
+}
+
+
+TEST(SeriesVolume, Irregular)
+{
+  const std::string orientation = "axial";
+
+  std::vector<SeriesVolume::Slice> slices;
+  AddSlice(slices, "a", &orientation, 0);
+  AddSlice(slices, "b", &orientation, 1);
+  AddSlice(slices, "c", &orientation, 3);
+
+  std::vector<size_t> order;
+  SeriesVolume volume;
+  Analyze(order, volume, slices);
+  ASSERT_TRUE(volume.IsGeometric());
+  ASSERT_FALSE(volume.IsUniform());
+  ASSERT_DOUBLE_EQ(1.5, volume.GetSliceSpacing());
+
+  // Overlapping slices, as in multiple echoes
+  slices[2].distance_ = 1;
+  Analyze(order, volume, slices);
+  ASSERT_TRUE(volume.IsGeometric());
+  ASSERT_FALSE(volume.IsUniform());
+  ASSERT_FALSE(volume.IsReconstructable());
+}
+
+
+TEST(SeriesVolume, InstanceNumber)
+{
+  const std::string axial = "axial";
+  const std::string sagittal = "sagittal";
+
+  // The orientations differ, so the positions are ignored
+  std::vector<SeriesVolume::Slice> slices;
+  AddSlice(slices, "d", &axial, 0);
+  AddSlice(slices, "c", &sagittal, 1);
+  AddSlice(slices, "b", &axial, 2);
+  AddSlice(slices, "a", &axial, 3);
+
+  slices[0].hasInstanceNumber_ = true;
+  slices[0].instanceNumber_ = 2;
+  slices[1].hasInstanceNumber_ = true;
+  slices[1].instanceNumber_ = 1;
+
+  std::vector<size_t> order;
+  SeriesVolume volume;
+  Analyze(order, volume, slices);
+
+  ASSERT_FALSE(volume.IsGeometric());
+  ASSERT_FALSE(volume.IsUniform());
+  ASSERT_FALSE(volume.IsReconstructable());
+
+  ASSERT_EQ(4u, order.size());
+  ASSERT_EQ(1u, order[0]);
+  ASSERT_EQ(0u, order[1]);
+  ASSERT_EQ(3u, order[2]);  // The instances without a number come last, by ID
+  ASSERT_EQ(2u, order[3]);
+
+  // An empty series is not a volume
+  slices.clear();
+  Analyze(order, volume, slices);
+  ASSERT_TRUE(order.empty());
+  ASSERT_FALSE(volume.IsGeometric());
+}
+
+
+int main(int argc, char **argv)
+{
+  ::testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}